@@ -0,0 +1,525 @@
+// Copyright (c) 2019 Daniel Abrecht
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/mman.h>
+#include <poll.h>
+#include <pty.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <limits.h>
+#include <termios.h>
+#include <time.h>
+#include <signal.h>
+#include <pthread.h>
+#include <alsa/asoundlib.h>
+
+// Opens the plugin through snd_pcm_open against a pty pair and plays the far end of the line itself.
+// In v253 mode, v253_splitter_daemon sits in between, and the bench plays the modem.
+// Each scenario runs twice: once unpaced, to see how fast the transfer path can go,
+// and once at the sample rate with an impulse every few periods, to see how long it takes
+// the audio to get through and how much CPU that costs.
+
+enum {
+  LINE_SILENCE = 0x80, // U8, which is what the line uses
+  LINE_IMPULSE = 0xFF,
+  IMPULSE_EVERY = 8, // Periods
+  TIMES_MAX = 4096,
+  RAW_BAUDRATE = 115200,
+  RAW_SAMPLERATE = RAW_BAUDRATE / 10, // 8N1 carries a byte per 10 bits
+  V253_SAMPLERATE = 8000
+};
+
+static const char* plugin = "bin/libasound_module_pcm_tty.so";
+static const char* daemon_path = "v253_splitter_daemon/v253_splitter_daemon";
+static double seconds = 2;
+
+struct line {
+  int master;
+  int slave; // Kept open, so the master doesn't hang up whenever the plugin closes the tty
+  char path[256]; // What the plugin or the daemon opens
+};
+
+// The other end of the line, runs in its own thread
+struct far_end {
+  pthread_t thread;
+  int fd;
+  snd_pcm_stream_t stream; // Of the plugin
+  bool paced;
+  unsigned rate;
+  size_t period;
+  bool stop;
+  uint64_t bytes;
+  uint64_t times[TIMES_MAX]; // Of impulses: seen for playback, sent for capture
+  size_t count;
+  uint64_t cpu; // ns the thread used
+};
+
+struct result {
+  double throughput; // Multiple of real time
+  double period_cost; // us per period spent in readi or writei
+  double latency[4]; // us: min, median, 99th percentile, max
+  size_t latency_count;
+  double cpu; // % of one core while running at the sample rate
+  double daemon_cpu;
+};
+
+static uint64_t now(void){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static uint64_t cpu_time(int who){
+  struct rusage ru;
+  getrusage(who, &ru);
+  return (uint64_t)(ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000000
+       + (uint64_t)(ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) * 1000;
+}
+
+// Of another process, from /proc
+static uint64_t process_cpu_time(pid_t pid){
+  char name[64];
+  snprintf(name, sizeof(name), "/proc/%d/stat", (int)pid);
+  FILE* f = fopen(name, "r");
+  if(!f)
+    return 0;
+  unsigned long utime = 0, stime = 0;
+  // Skip to the 14th field, the name in the 2nd field has no spaces here
+  if(fscanf(f, "%*d %*s %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &utime, &stime) != 2)
+    utime = stime = 0;
+  fclose(f);
+  return (uint64_t)(utime + stime) * 1000000000 / sysconf(_SC_CLK_TCK);
+}
+
+static void* far_end_run(void* arg){
+  struct far_end* f = arg;
+  uint64_t cpu_start = cpu_time(RUSAGE_THREAD);
+  uint8_t buf[4096];
+  if(f->stream == SND_PCM_STREAM_PLAYBACK){
+    // Read whatever arrives, note when the impulses do
+    while(!__atomic_load_n(&f->stop, __ATOMIC_ACQUIRE)){
+      if(poll(&(struct pollfd){ .fd = f->fd, .events = POLLIN }, 1, 50) <= 0)
+        continue;
+      ssize_t s = read(f->fd, buf, sizeof(buf));
+      if(s <= 0)
+        continue;
+      uint64_t t = now();
+      f->bytes += s;
+      if(f->paced)
+        for(ssize_t i=0; i<s; i++)
+          if(buf[i] >= 0xF0 && f->count < TIMES_MAX)
+            f->times[f->count++] = t;
+    }
+  }else{
+    // Send a period at a time at the sample rate, or as fast as the tty takes it
+    uint64_t next = now();
+    uint64_t period_ns = (uint64_t)f->period * 1000000000 / f->rate;
+    size_t periods = 0;
+    memset(buf, LINE_SILENCE, sizeof(buf));
+    while(!__atomic_load_n(&f->stop, __ATOMIC_ACQUIRE)){
+      size_t n = f->paced ? f->period : sizeof(buf);
+      if(f->paced){
+        next += period_ns;
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &(struct timespec){ .tv_sec = next / 1000000000, .tv_nsec = next % 1000000000 }, 0);
+        buf[0] = periods++ % IMPULSE_EVERY ? LINE_SILENCE : LINE_IMPULSE;
+      }
+      if(poll(&(struct pollfd){ .fd = f->fd, .events = POLLOUT }, 1, 50) <= 0)
+        continue;
+      uint64_t t = now();
+      ssize_t s = write(f->fd, buf, n);
+      if(s <= 0)
+        continue;
+      if(f->paced && buf[0] == LINE_IMPULSE && f->count < TIMES_MAX)
+        f->times[f->count++] = t;
+      f->bytes += s;
+    }
+  }
+  f->cpu = cpu_time(RUSAGE_THREAD) - cpu_start;
+  return 0;
+}
+
+static int line_open(struct line* line, const char* dir, const char* name){
+  char pts[256];
+  if(openpty(&line->master, &line->slave, pts, 0, 0) == -1){
+    perror("openpty");
+    return -1;
+  }
+  fcntl(line->master, F_SETFL, fcntl(line->master, F_GETFL) | O_NONBLOCK);
+  // The daemon puts its fake modem next to the device, which can't be done in /dev/pts
+  snprintf(line->path, sizeof(line->path), "%s/%s", dir, name);
+  unlink(line->path);
+  if(symlink(pts, line->path) == -1){
+    perror("symlink");
+    close(line->master);
+    close(line->slave);
+    return -1;
+  }
+  return 0;
+}
+
+static void line_close(struct line* line){
+  unlink(line->path);
+  close(line->master);
+  close(line->slave);
+}
+
+static void sample_set(snd_pcm_format_t format, void* buf, size_t i, bool impulse){
+  switch(format){
+    case SND_PCM_FORMAT_U8: ((uint8_t*)buf)[i] = impulse ? 0xFF : 0x80; break;
+    case SND_PCM_FORMAT_S16_LE: ((int16_t*)buf)[i] = impulse ? INT16_MAX : 0; break;
+    case SND_PCM_FORMAT_S32_LE: ((int32_t*)buf)[i] = impulse ? INT32_MAX : 0; break;
+    case SND_PCM_FORMAT_FLOAT_LE: ((float*)buf)[i] = impulse ? 1 : 0; break;
+    default: break;
+  }
+}
+
+static bool sample_is_impulse(snd_pcm_format_t format, const void* buf, size_t i){
+  switch(format){
+    case SND_PCM_FORMAT_U8: return ((const uint8_t*)buf)[i] >= 0xF0;
+    case SND_PCM_FORMAT_S16_LE: return ((const int16_t*)buf)[i] > INT16_MAX / 2;
+    case SND_PCM_FORMAT_S32_LE: return ((const int32_t*)buf)[i] > INT32_MAX / 2;
+    case SND_PCM_FORMAT_FLOAT_LE: return ((const float*)buf)[i] > 0.5f;
+    default: return false;
+  }
+}
+
+static int pcm_open(snd_pcm_t** pcm, const char* mode, const char* io, const char* device, snd_pcm_stream_t stream, unsigned latency){
+  char conf[1024];
+  if(!strcmp(mode, "v253")){
+    snprintf(conf, sizeof(conf),
+      "pcm_type.tty { lib \"%s\" }\n"
+      "pcm.bench { type tty device \"%s\" mode v253 format U8 latency %u }\n",
+      plugin, device, latency
+    );
+  }else{
+    snprintf(conf, sizeof(conf),
+      "pcm_type.tty { lib \"%s\" }\n"
+      "pcm.bench { type tty device \"%s\" mode raw io %s format U8 baudrate %d samplerate %d latency %u }\n",
+      plugin, device, io, RAW_BAUDRATE, RAW_SAMPLERATE, latency
+    );
+  }
+  snd_config_t* top = 0;
+  snd_input_t* in = 0;
+  int error = snd_config_top(&top);
+  if(error >= 0)
+    error = snd_input_buffer_open(&in, conf, strlen(conf));
+  if(error >= 0)
+    error = snd_config_load(top, in);
+  if(in)
+    snd_input_close(in);
+  if(error >= 0)
+    error = snd_pcm_open_lconf(pcm, "bench", stream, SND_PCM_NONBLOCK, top);
+  if(top)
+    snd_config_delete(top);
+  return error;
+}
+
+static int compare(const void* a, const void* b){
+  double x = *(const double*)a, y = *(const double*)b;
+  return x < y ? -1 : x > y;
+}
+
+// One run, unpaced or at the sample rate
+static int run(struct result* result, bool paced, const char* mode, const char* io, struct line* line, snd_pcm_stream_t stream, snd_pcm_format_t format, unsigned latency, pid_t daemon_pid){
+  snd_pcm_t* pcm;
+  int error = pcm_open(&pcm, mode, io, line->path, stream, latency);
+  if(error < 0){
+    fprintf(stderr, "snd_pcm_open failed: %s\n", snd_strerror(error));
+    return error;
+  }
+  unsigned rate = strcmp(mode, "v253") ? RAW_SAMPLERATE : V253_SAMPLERATE;
+  error = snd_pcm_set_params(pcm, format, SND_PCM_ACCESS_RW_INTERLEAVED, 1, rate, 0, latency * 1000);
+  snd_pcm_uframes_t buffer_size = 0, period_size = 0;
+  if(error >= 0)
+    error = snd_pcm_get_params(pcm, &buffer_size, &period_size);
+  if(error < 0){
+    fprintf(stderr, "snd_pcm_set_params failed: %s\n", snd_strerror(error));
+    snd_pcm_close(pcm);
+    return error;
+  }
+
+  // Whatever is left over from the last run
+  uint8_t junk[4096];
+  while(read(line->master, junk, sizeof(junk)) > 0);
+
+  static struct far_end f;
+  memset(&f, 0, sizeof(f));
+  f.fd = line->master;
+  f.stream = stream;
+  f.paced = paced;
+  f.rate = rate;
+  f.period = period_size;
+  pthread_create(&f.thread, 0, far_end_run, &f);
+
+  size_t sample_bytes = snd_pcm_format_physical_width(format) / 8;
+  uint8_t* buf = calloc(period_size, sample_bytes);
+  static uint64_t times[TIMES_MAX];
+  size_t count = 0;
+  uint64_t frames = 0, busy = 0, periods = 0;
+  uint64_t period_ns = (uint64_t)period_size * 1000000000 / rate;
+  uint64_t start = now(), next = start;
+  uint64_t cpu_start = cpu_time(RUSAGE_SELF);
+  uint64_t daemon_start = daemon_pid ? process_cpu_time(daemon_pid) : 0;
+  if(stream == SND_PCM_STREAM_CAPTURE)
+    snd_pcm_start(pcm);
+  while(now() - start < seconds * 1000000000){
+    if(stream == SND_PCM_STREAM_PLAYBACK){
+      bool impulse = paced && !(periods % IMPULSE_EVERY);
+      for(size_t i=0; i<period_size; i++)
+        sample_set(format, buf, i, impulse && !i);
+      size_t done = 0;
+      while(done < period_size){
+        uint64_t t = now();
+        snd_pcm_sframes_t s = snd_pcm_writei(pcm, buf + done * sample_bytes, period_size - done);
+        busy += now() - t;
+        if(s == -EAGAIN){
+          snd_pcm_wait(pcm, 100);
+          continue;
+        }
+        if(s < 0){
+          snd_pcm_recover(pcm, s, 1);
+          continue;
+        }
+        if(impulse && !done && count < TIMES_MAX)
+          times[count++] = now();
+        done += s;
+        frames += s;
+      }
+      periods++;
+      if(paced){
+        next += period_ns;
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &(struct timespec){ .tv_sec = next / 1000000000, .tv_nsec = next % 1000000000 }, 0);
+      }
+    }else{
+      uint64_t t = now();
+      snd_pcm_sframes_t s = snd_pcm_readi(pcm, buf, period_size);
+      busy += now() - t;
+      if(s == -EAGAIN){
+        snd_pcm_wait(pcm, 100);
+        continue;
+      }
+      if(s < 0){
+        snd_pcm_recover(pcm, s, 1);
+        snd_pcm_start(pcm);
+        continue;
+      }
+      t = now();
+      for(snd_pcm_sframes_t i=0; i<s; i++)
+        if(paced && sample_is_impulse(format, buf, i) && count < TIMES_MAX)
+          times[count++] = t;
+      frames += s;
+      periods++;
+    }
+  }
+  uint64_t elapsed = now() - start;
+  uint64_t cpu = cpu_time(RUSAGE_SELF) - cpu_start;
+  uint64_t daemon_cpu = daemon_pid ? process_cpu_time(daemon_pid) - daemon_start : 0;
+  if(stream == SND_PCM_STREAM_PLAYBACK && paced)
+    snd_pcm_drain(pcm);
+  __atomic_store_n(&f.stop, true, __ATOMIC_RELEASE);
+  pthread_join(f.thread, 0);
+  snd_pcm_close(pcm);
+  free(buf);
+
+  if(!paced){
+    result->throughput = (double)frames / rate / (elapsed / 1e9);
+    result->period_cost = periods ? busy / 1e3 / ((double)frames / period_size) : 0;
+    return 0;
+  }
+  // The bench itself and the far end don't count
+  result->cpu = (double)(cpu - f.cpu) / elapsed * 100;
+  result->daemon_cpu = (double)daemon_cpu / elapsed * 100;
+  // Impulses are matched up in order. Playback: written here, seen at the far end. Capture: the other way around.
+  const uint64_t* sent = stream == SND_PCM_STREAM_PLAYBACK ? times : f.times;
+  const uint64_t* seen = stream == SND_PCM_STREAM_PLAYBACK ? f.times : times;
+  size_t n = count < f.count ? count : f.count;
+  double* latency_us = calloc(n ? n : 1, sizeof(double));
+  size_t m = 0;
+  for(size_t i=0; i<n; i++)
+    if(seen[i] >= sent[i])
+      latency_us[m++] = (seen[i] - sent[i]) / 1e3;
+  qsort(latency_us, m, sizeof(double), compare);
+  result->latency_count = m;
+  if(m){
+    result->latency[0] = latency_us[0];
+    result->latency[1] = latency_us[m / 2];
+    result->latency[2] = latency_us[m * 99 / 100];
+    result->latency[3] = latency_us[m - 1];
+  }
+  free(latency_us);
+  return 0;
+}
+
+// Reads from the modem until it has seen what it waits for
+static bool expect(int fd, const char* what, int ms){
+  char buf[256];
+  size_t size = 0;
+  uint64_t end = now() + (uint64_t)ms * 1000000;
+  while(now() < end){
+    if(poll(&(struct pollfd){ .fd = fd, .events = POLLIN }, 1, 50) <= 0)
+      continue;
+    ssize_t s = read(fd, buf + size, sizeof(buf) - 1 - size);
+    if(s <= 0)
+      continue;
+    size += s;
+    buf[size] = 0;
+    if(strstr(buf, what))
+      return true;
+    if(size == sizeof(buf) - 1)
+      size = 0;
+  }
+  return false;
+}
+
+// Starts v253_splitter_daemon on the line and puts the modem into voice mode
+static pid_t daemon_start(struct line* line){
+  pid_t pid = fork();
+  if(pid == -1){
+    perror("fork");
+    return -1;
+  }
+  if(!pid){
+    execl(daemon_path, daemon_path, line->path, (char*)0);
+    perror("execl");
+    _exit(1);
+  }
+  char link[300];
+  snprintf(link, sizeof(link), "%s:AT", line->path);
+  int fake = -1;
+  for(int i=0; i<100 && fake == -1; i++){
+    fake = open(link, O_RDWR | O_NOCTTY | O_NONBLOCK);
+    if(fake == -1)
+      usleep(20000);
+  }
+  if(fake == -1){
+    fprintf(stderr, "v253_splitter_daemon didn't create %s\n", link);
+    goto backout;
+  }
+  struct termios termios;
+  tcgetattr(fake, &termios);
+  cfmakeraw(&termios);
+  tcsetattr(fake, TCSANOW, &termios);
+  if(write(fake, "AT+VTR\r", 7) != 7 || !expect(line->master, "AT+VTR", 2000)){
+    fprintf(stderr, "v253_splitter_daemon didn't pass AT+VTR on\n");
+    goto backout;
+  }
+  if(write(line->master, "\r\nOK\r\n", 6) != 6 || !expect(fake, "OK", 2000)){
+    fprintf(stderr, "v253_splitter_daemon didn't enter voice mode\n");
+    goto backout;
+  }
+  close(fake);
+  return pid;
+
+backout:
+  if(fake != -1)
+    close(fake);
+  kill(pid, SIGTERM);
+  waitpid(pid, 0, 0);
+  return -1;
+}
+
+static void daemon_stop(pid_t pid, struct line* line){
+  kill(pid, SIGTERM);
+  waitpid(pid, 0, 0);
+  // It had no chance to clean up after itself
+  struct stat st;
+  if(stat(line->path, &st) == -1)
+    return;
+  char name[300];
+  snprintf(name, sizeof(name), "tty-pcm:%x.%x", major(st.st_rdev), minor(st.st_rdev));
+  shm_unlink(name);
+  snprintf(name, sizeof(name), "tty-pcm-stats:%d:%x.%x:daemon", (int)pid, major(st.st_rdev), minor(st.st_rdev));
+  shm_unlink(name);
+  snprintf(name, sizeof(name), "%s:AT", line->path);
+  unlink(name);
+}
+
+int main(int argc, char* argv[]){
+  int opt;
+  while((opt = getopt(argc, argv, "p:d:t:")) != -1){
+    switch(opt){
+      case 'p': plugin = optarg; break;
+      case 'd': daemon_path = optarg; break;
+      case 't': seconds = atof(optarg); break;
+      default:
+        fprintf(stderr, "Usage: %s [-p plugin.so] [-d v253_splitter_daemon] [-t seconds per run]\n", argv[0]);
+        return 1;
+    }
+  }
+  // ALSA loads the plugin from the configuration, which wants an absolute path
+  static char plugin_path[PATH_MAX];
+  if(!realpath(plugin, plugin_path)){
+    fprintf(stderr, "%s: %s, build it first\n", plugin, strerror(errno));
+    return 1;
+  }
+  plugin = plugin_path;
+
+  char dir[] = "/tmp/pcm_tty_bench.XXXXXX";
+  if(!mkdtemp(dir)){
+    perror("mkdtemp");
+    return 1;
+  }
+
+  static const struct { const char* mode; const char* io; } modes[] = {
+    { "raw", "direct" },
+    { "raw", "thread" },
+    { "raw", "uring" },
+    { "v253", "shm" },
+  };
+  static const snd_pcm_format_t formats[] = { SND_PCM_FORMAT_U8, SND_PCM_FORMAT_S16_LE, SND_PCM_FORMAT_S32_LE, SND_PCM_FORMAT_FLOAT_LE };
+  static const unsigned latencies[] = { 20, 100 };
+  static const snd_pcm_stream_t streams[] = { SND_PCM_STREAM_PLAYBACK, SND_PCM_STREAM_CAPTURE };
+
+  printf("%-4s %-6s %-8s %-8s %4s | %9s %9s | %9s %9s %9s %9s | %6s %6s\n",
+    "mode", "io", "stream", "format", "ms", "x rt", "us/per", "lat min", "lat p50", "lat p99", "lat max", "cpu%", "dmn%");
+  int ret = 0;
+  for(size_t i=0; i<sizeof(modes)/sizeof(*modes); i++){
+    struct line line;
+    if(line_open(&line, dir, modes[i].mode) < 0){
+      ret = 1;
+      break;
+    }
+    pid_t daemon_pid = 0;
+    if(!strcmp(modes[i].mode, "v253")){
+      daemon_pid = daemon_start(&line);
+      if(daemon_pid < 0){
+        line_close(&line);
+        ret = 1;
+        continue;
+      }
+    }
+    for(size_t s=0; s<sizeof(streams)/sizeof(*streams); s++)
+    for(size_t f=0; f<sizeof(formats)/sizeof(*formats); f++)
+    for(size_t l=0; l<sizeof(latencies)/sizeof(*latencies); l++){
+      struct result result = {0};
+      if( run(&result, false, modes[i].mode, modes[i].io, &line, streams[s], formats[f], latencies[l], daemon_pid) < 0
+       || run(&result, true, modes[i].mode, modes[i].io, &line, streams[s], formats[f], latencies[l], daemon_pid) < 0
+      ){
+        ret = 1;
+        continue;
+      }
+      printf("%-4s %-6s %-8s %-8s %4u | %9.2f %9.2f | %9.0f %9.0f %9.0f %9.0f | %6.2f %6.2f\n",
+        modes[i].mode, modes[i].io, snd_pcm_stream_name(streams[s]), snd_pcm_format_name(formats[f]), latencies[l],
+        result.throughput, result.period_cost,
+        result.latency[0], result.latency[1], result.latency[2], result.latency[3],
+        result.cpu, result.daemon_cpu
+      );
+      fflush(stdout);
+    }
+    if(daemon_pid)
+      daemon_stop(daemon_pid, &line);
+    line_close(&line);
+  }
+  rmdir(dir);
+  return ret;
+}
@@ -10,6 +10,11 @@
 #include <termios.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <pthread.h>
+#include <pcm_tty_ring.h>
+#include <pcm_tty_trace.h>
+#include <pcm_tty_stats.h>
+#include <pcm_tty_segment.h>
 
 #ifndef SND_PCM_IOPLUG_FLAG_BOUNDARY_WA
 #define SND_PCM_IOPLUG_FLAG_BOUNDARY_WA (1<<2)
@@ -35,13 +40,39 @@
 DECLARE_IOPLUG_CALLBACKS(playback)
 DECLARE_IOPLUG_CALLBACKS(capture)
 
+// Each stream gets one of these callback tables when it's opened. They are the playback or capture
+// table with the transfer callback for the io mode and frame size, so that one needn't check them.
+#define PCM_TTY_TRANSFER_VARIANTS \
+  X(direct) /* Frames of several bytes, which may get transferred partially */ \
+  X(direct_byte) /* Single byte frames */ \
+  X(resample) \
+  X(thread) \
+  X(uring) \
+  X(shm)
+
+#define X(Y) \
+  DECLARE_IOPLUG_CALLBACKS(playback_ ## Y) \
+  DECLARE_IOPLUG_CALLBACKS(capture_ ## Y)
+PCM_TTY_TRANSFER_VARIANTS
+#undef X
+
 #define PCM_TTY_MODES \
   X(raw) \
   X(v253)
 
+#define PCM_TTY_IO_MODES \
+  X(direct) \
+  X(thread) \
+  X(uring) \
+  X(shm)
+
 enum {
-  C_DLE = 0x10,
-  C_SUB = 0x1A
+  PCM_TTY_BUFFER_BYTES_MAX = 1<<20,
+  PCM_TTY_LATENCY_DEFAULT = 500, // ms
+  PCM_TTY_PERIOD_TIME_MIN = 2, // ms
+  PCM_TTY_PERIODS_MAX = 1024,
+  PCM_TTY_CHANNELS_MAX = 32,
+  PCM_TTY_FRAME_BYTES_MAX = PCM_TTY_CHANNELS_MAX * 8
 };
 
 enum pcm_tty_mode {
@@ -51,28 +82,180 @@ enum pcm_tty_mode {
 #undef X
 };
 
+enum pcm_tty_io {
+  PCM_TTY_IO_INVALID = -1,
+#define X(Y) PCM_TTY_IO_ ## Y,
+  PCM_TTY_IO_MODES
+#undef X
+};
+
 struct pcm_tty_settings {
   char* device;
   snd_pcm_format_t format;
   unsigned long baudrate;
   unsigned long samplerate;
+  unsigned channels;
+  unsigned latency; // ms, the most audio the buffer may hold
+  unsigned period_time; // ms, derived from the latency if not set
   tcflag_t iflag;
   tcflag_t oflag;
   tcflag_t cflag;
   tcflag_t lflag;
+  int vmin; // -1 if not set
+  int vtime; // 1/10 s, -1 if not set
+  unsigned latency_timer; // ms, USB serial adapters which have one, like FTDI
+  unsigned rx_trigger; // Bytes the receive FIFO holds before the UART raises an interrupt
   enum pcm_tty_mode mode;
+  enum pcm_tty_io io;
+  bool hw_pointer; // Don't count data still in the kernel tty buffer as played
+  bool resample; // Follow the rate the line actually runs at, direct io mode only
+  bool trace; // Record what the stream does in shared memory, for pcm_tty_trace_dump
+  bool stats; // Keep counters in shared memory, for pcm_tty_stats
+  bool low_latency; // Have the driver pass on received data right away, see serial.c
+};
+
+// What was changed by serial_low_latency, pcm_tty_serial_restore puts it back when the stream is closed
+struct pcm_tty_serial_saved {
+  bool low_latency; // ASYNC_LOW_LATENCY wasn't set before
+  unsigned latency_timer; // The previous values, 0 if they weren't changed
+  unsigned rx_trigger;
+};
+
+struct pcm_tty_uring;
+
+// Conversion between the format the application uses and the one used on the line
+struct pcm_tty_convert {
+  bool active;
+  size_t app_bytes; // Bytes per sample of the application format
+  void (*app_to_s16)(int16_t* dst, const void* src, size_t count); // 0 if the application format is s16
+  void (*s16_to_app)(void* dst, const int16_t* src, size_t count);
+  void (*s16_to_line)(uint8_t* dst, const int16_t* src, size_t count);
+  void (*line_to_s16)(int16_t* dst, const uint8_t* src, size_t count);
+};
+
+enum { PCM_TTY_RESAMPLE_SAMPLES = 1024 };
+
+// Converts between the sample rate and the rate the line actually runs at, see resample.c
+struct pcm_tty_resampler {
+  bool active;
+  double step; // Input frames per output frame
+  double position; // Of the next output frame, between the previous input frame and the one after it
+  int16_t previous[PCM_TTY_CHANNELS_MAX];
+  double line_rate; // Bytes per second the line was measured to carry, 0 until known
+  uint64_t line_bytes; // Written to or read from the tty
+  bool measuring;
+  bool window_valid; // False if the line was idle during the window
+  struct timespec window_start;
+  uint64_t window_bytes; // Bytes which went over the line before the window started
+  double window_delay; // Sum of the delays seen during the window
+  unsigned window_samples;
+  double target_delay; // Frames, the delay to keep, negative until known
+  size_t pending; // Playback: bytes converted but not written yet, capture: frames read but not resampled yet
+  size_t pending_offset;
+  union {
+    uint8_t line[PCM_TTY_RESAMPLE_SAMPLES];
+    int16_t s16[PCM_TTY_RESAMPLE_SAMPLES];
+  } buffer;
+};
+
+struct pcm_tty_thread {
+  pthread_t id;
+  bool running;
+  bool stop;
+  bool sleeping;
+  int wake_fd; // eventfd, wakes up the thread
+  int notify_fd; // eventfd, signaled by the thread whenever it made progress
+  int error; // Negative errno the thread gave up with, set before it signals notify_fd a last time
 };
 
 struct tty_snd_plug {
   snd_pcm_ioplug_t ioplug;
+  snd_pcm_stream_t stream;
   struct pcm_tty_settings settings;
-  int shm_fd;
-  volatile const uint8_t* shm;
+  void* shm; // The shared memory of v253_splitter_daemon, the ring is in there
+  size_t shm_size; // Of the mapping, the size in the control block could have been changed by anyone
+  int shm_socket; // Connection to v253_splitter_daemon, it hands out the eventfds below
+  int shm_notify_fd; // eventfd, signaled by the daemon on state changes and whenever it moved audio
+  int shm_doorbell_fd; // eventfd, wakes up the daemon
+  uint32_t shm_seq; // State change count last seen
   int device_fd;
+  struct pcm_tty_serial_saved serial_saved;
+  int timer_fd; // Expires once per period, direct io mode only
   snd_pcm_sframes_t virtual_offset;
+  snd_pcm_sframes_t last_pointer;
+  uint64_t arrival; // CLOCK_MONOTONIC ns, when captured data last came in. The reader thread sets it too.
+  unsigned long byte_rate; // Bytes per second the line carries
+  size_t frame_bytes; // In the line format
+  size_t app_frame_bytes;
+  struct pcm_tty_convert convert;
+  struct pcm_tty_resampler resampler;
+  snd_pcm_uframes_t buffer_frames_max;
+  snd_pcm_uframes_t period_frames_min;
+  snd_pcm_uframes_t period_frames_max;
+  size_t partial; // Bytes of an incomplete frame already transferred
+  uint8_t partial_frame[PCM_TTY_FRAME_BYTES_MAX]; // Captured bytes of that incomplete frame
+  struct pcm_tty_ring* ring;
+  uint32_t ring_size; // Checked copy, the one in the ring header isn't trusted for shared memory rings
+  uint32_t ring_position; // Ring position virtual_offset was last updated to
+  uint32_t ring_drop; // Playback ring data before this position is to be discarded
+  struct pcm_tty_thread thread;
+  struct pcm_tty_uring* uring;
+  struct pcm_tty_trace* trace;
+  char trace_name[PCM_TTY_SEGMENT_NAME_MAX];
+  struct pcm_tty_stats* stats;
+  char stats_name[PCM_TTY_SEGMENT_NAME_MAX];
 };
 
 int pcm_tty_indexof(const char* search, const char*const* list);
+snd_pcm_sframes_t pcm_tty_line_delay(const struct tty_snd_plug* tty, size_t size);
+int pcm_tty_queued(const struct tty_snd_plug* tty);
+snd_pcm_uframes_t pcm_tty_line_frames(const struct tty_snd_plug* tty, unsigned ms);
+uint64_t pcm_tty_now(void);
+void pcm_tty_arrived(struct tty_snd_plug* tty);
+snd_pcm_sframes_t pcm_tty_since_arrival(const struct tty_snd_plug* tty);
+unsigned pcm_tty_char_bits(tcflag_t cflag);
+int pcm_tty_set_baudrate(int fd, unsigned long in, unsigned long out);
+int pcm_tty_get_baudrate(int fd, unsigned long* in, unsigned long* out);
+int pcm_tty_serial_low_latency(int fd, bool enable);
+int pcm_tty_serial_attribute(int fd, const char* attribute, unsigned value);
+int pcm_tty_serial_attribute_get(int fd, const char* attribute, unsigned* value);
+void pcm_tty_serial_restore(int fd, const struct pcm_tty_serial_saved* saved);
+int pcm_tty_hw_params(struct tty_snd_plug* tty);
+size_t pcm_tty_convert_formats(snd_pcm_format_t line, unsigned formats[], size_t max);
+int pcm_tty_convert_init(struct pcm_tty_convert* convert, snd_pcm_format_t app, snd_pcm_format_t line, bool via_s16);
+void pcm_tty_encode(const struct pcm_tty_convert* convert, uint8_t* dst, const void* src, size_t count);
+void pcm_tty_decode(const struct pcm_tty_convert* convert, void* dst, const uint8_t* src, size_t count);
+void pcm_tty_close(struct tty_snd_plug* tty);
+int pcm_tty_thread_start(struct tty_snd_plug* tty);
+void pcm_tty_thread_stop(struct tty_snd_plug* tty);
+void pcm_tty_thread_wake(struct tty_snd_plug* tty);
+int pcm_tty_thread_error(const struct tty_snd_plug* tty);
+int pcm_tty_uring_start(struct tty_snd_plug* tty);
+void pcm_tty_uring_stop(struct tty_snd_plug* tty);
+int pcm_tty_uring_update(struct tty_snd_plug* tty);
+int pcm_tty_uring_fd(struct tty_snd_plug* tty);
+int pcm_tty_shm_attach(struct tty_snd_plug* tty);
+void pcm_tty_shm_detach(struct tty_snd_plug* tty);
+void pcm_tty_shm_kick(struct tty_snd_plug* tty);
+void pcm_tty_shm_ack(struct tty_snd_plug* tty);
+int pcm_tty_timer_open(struct tty_snd_plug* tty);
+void pcm_tty_timer_close(struct tty_snd_plug* tty);
+int pcm_tty_timer_arm(struct tty_snd_plug* tty);
+void pcm_tty_timer_disarm(struct tty_snd_plug* tty);
+unsigned short pcm_tty_timer_revents(struct tty_snd_plug* tty, const struct pollfd* pfd);
+int pcm_tty_poll_descriptors_count(struct tty_snd_plug* tty);
+int pcm_tty_poll_descriptors(struct tty_snd_plug* tty, struct pollfd* pfd, unsigned space);
+int pcm_tty_segment_open(struct tty_snd_plug* tty, const char* kind, mode_t mode, size_t size, char name[PCM_TTY_SEGMENT_NAME_MAX], void** segment);
+int pcm_tty_stats_open(struct tty_snd_plug* tty);
+void pcm_tty_stats_close(struct tty_snd_plug* tty);
+int pcm_tty_trace_open(struct tty_snd_plug* tty);
+void pcm_tty_trace_close(struct tty_snd_plug* tty);
+void pcm_tty_trace(struct tty_snd_plug* tty, unsigned event, int64_t a, int64_t b);
+void pcm_tty_resample_reset(struct tty_snd_plug* tty);
+void pcm_tty_resample_update(struct tty_snd_plug* tty, int queued);
+snd_pcm_sframes_t pcm_tty_resample_app_frames(const struct tty_snd_plug* tty, size_t line_frames);
+snd_pcm_sframes_t pcm_tty_resample_write(struct tty_snd_plug* tty, const void* src, size_t frames);
+snd_pcm_sframes_t pcm_tty_resample_read(struct tty_snd_plug* tty, void* dst, size_t frames);
 
 #ifdef __GNUC__
 int m_debug(const char* format, ...) __attribute__((format(printf, 1, 2)));
@@ -0,0 +1,38 @@
+// Copyright (c) 2019 Daniel Abrecht
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#ifndef PCM_TTY_DLE_H
+#define PCM_TTY_DLE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+enum {
+  C_DLE = 0x10,
+  C_SUB = 0x1A
+};
+
+enum { PCM_TTY_V253_EVENT_QUEUE_SIZE = 32 };
+
+// Decoder state for the modem to host direction, kept across reads
+struct pcm_tty_v253_decoder {
+  bool dle; // The last byte was an unpaired DLE
+  unsigned event_read, event_write;
+  uint8_t event[PCM_TTY_V253_EVENT_QUEUE_SIZE]; // Shielded codes other than DLE and SUB, like ETX, DTMF digits or b for busy
+};
+
+// Returns the index of the first C_DLE in data, or size if there is none
+extern size_t (*pcm_tty_dle_find)(const uint8_t* data, size_t size);
+
+// Shields as much of src as fits into dst. *src_size is updated to the number of bytes consumed.
+size_t pcm_tty_dle_shield(uint8_t*restrict dst, size_t dst_size, const uint8_t*restrict src, size_t* src_size);
+
+// Removes the shielding in a single pass. Returns the number of bytes written, at most d->dle + size.
+// To decode in place, dst has to be d->dle bytes before src: A DLE SUB split across reads
+// turns its second byte into two DLEs.
+size_t pcm_tty_v253_decode(struct pcm_tty_v253_decoder* d, uint8_t* dst, const uint8_t* src, size_t size);
+// Returns the next shielded event code, or -1 if there is none
+int pcm_tty_v253_event_pop(struct pcm_tty_v253_decoder* d);
+
+#endif
@@ -0,0 +1,101 @@
+// Copyright (c) 2019 Daniel Abrecht
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#ifndef PCM_TTY_RING_H
+#define PCM_TTY_RING_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+// Lock-free single producer, single consumer byte ring.
+// The positions are free running, the size must be a power of two.
+// It contains no pointers, so it can be placed in shared memory.
+// The accessors take the size from the caller, who has to have checked it,
+// a ring in shared memory can have its size changed under it at any time.
+struct pcm_tty_ring {
+  uint32_t size;
+  uint8_t pad0[60];
+  uint32_t read;  // Only written by the consumer
+  uint8_t pad1[60];
+  uint32_t write; // Only written by the producer
+  uint8_t pad2[60];
+  uint8_t data[];
+};
+
+static inline void pcm_tty_ring_init(struct pcm_tty_ring* ring, uint32_t size){
+  memset(ring, 0, sizeof(*ring));
+  ring->size = size;
+}
+
+static inline uint32_t pcm_tty_ring_read_position(const struct pcm_tty_ring* ring){
+  return __atomic_load_n(&ring->read, __ATOMIC_ACQUIRE);
+}
+
+static inline uint32_t pcm_tty_ring_write_position(const struct pcm_tty_ring* ring){
+  return __atomic_load_n(&ring->write, __ATOMIC_ACQUIRE);
+}
+
+static inline uint32_t pcm_tty_ring_fill(const struct pcm_tty_ring* ring){
+  return pcm_tty_ring_write_position(ring) - pcm_tty_ring_read_position(ring);
+}
+
+// Returns the contiguous free space after the write position
+static inline size_t pcm_tty_ring_reserve(struct pcm_tty_ring* ring, uint32_t size, uint8_t** data){
+  uint32_t w = ring->write;
+  uint32_t space = size - (w - pcm_tty_ring_read_position(ring));
+  uint32_t offset = w & (size - 1);
+  *data = ring->data + offset;
+  return space < size - offset ? space : size - offset;
+}
+
+static inline void pcm_tty_ring_commit(struct pcm_tty_ring* ring, size_t size){
+  __atomic_store_n(&ring->write, ring->write + (uint32_t)size, __ATOMIC_RELEASE);
+}
+
+// Returns the contiguous data after the read position
+static inline size_t pcm_tty_ring_peek(struct pcm_tty_ring* ring, uint32_t size, const uint8_t** data){
+  uint32_t r = ring->read;
+  uint32_t fill = pcm_tty_ring_write_position(ring) - r;
+  uint32_t offset = r & (size - 1);
+  *data = ring->data + offset;
+  return fill < size - offset ? fill : size - offset;
+}
+
+static inline void pcm_tty_ring_consume(struct pcm_tty_ring* ring, size_t size){
+  __atomic_store_n(&ring->read, ring->read + (uint32_t)size, __ATOMIC_RELEASE);
+}
+
+static inline size_t pcm_tty_ring_put(struct pcm_tty_ring* ring, uint32_t ring_size, const void* data, size_t size){
+  size_t done = 0;
+  for(int i=0; i<2 && done<size; i++){
+    uint8_t* dst;
+    size_t n = pcm_tty_ring_reserve(ring, ring_size, &dst);
+    if(!n)
+      break;
+    if(n > size - done)
+      n = size - done;
+    memcpy(dst, (const uint8_t*)data + done, n);
+    pcm_tty_ring_commit(ring, n);
+    done += n;
+  }
+  return done;
+}
+
+static inline size_t pcm_tty_ring_get(struct pcm_tty_ring* ring, uint32_t ring_size, void* data, size_t size){
+  size_t done = 0;
+  for(int i=0; i<2 && done<size; i++){
+    const uint8_t* src;
+    size_t n = pcm_tty_ring_peek(ring, ring_size, &src);
+    if(!n)
+      break;
+    if(n > size - done)
+      n = size - done;
+    memcpy((uint8_t*)data + done, src, n);
+    pcm_tty_ring_consume(ring, n);
+    done += n;
+  }
+  return done;
+}
+
+#endif
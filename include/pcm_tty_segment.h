@@ -0,0 +1,19 @@
+// Copyright (c) 2019 Daniel Abrecht
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#ifndef PCM_TTY_SEGMENT_H
+#define PCM_TTY_SEGMENT_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+// Shared memory segments for tools to look at, the plugin and v253_splitter_daemon both have some
+enum {
+  PCM_TTY_SEGMENT_NAME_MAX = 64
+};
+
+// Creates a segment named <kind>:<pid>:<major>.<minor>:<owner>. Returns 0 or a negative errno, the name is set either way.
+int pcm_tty_segment_create(const char* kind, dev_t rdev, const char* owner, mode_t mode, size_t size, char name[PCM_TTY_SEGMENT_NAME_MAX], void** segment);
+void pcm_tty_segment_destroy(const char* name, void* segment, size_t size);
+
+#endif
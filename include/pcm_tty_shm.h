@@ -0,0 +1,72 @@
+// Copyright (c) 2019 Daniel Abrecht
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#ifndef PCM_TTY_SHM_H
+#define PCM_TTY_SHM_H
+
+#include <stdint.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <pcm_tty_ring.h>
+
+// Layout of the tty-pcm:<major>.<minor> shared memory segment of v253_splitter_daemon.
+// The daemon owns the modem. It takes playback audio from the playback ring and puts
+// the audio it receives into the capture ring, the plugin only ever touches the rings.
+// The first page holds the control block, each ring gets an extra page of room for its header.
+enum {
+  PCM_TTY_SHM_PAGE = 4096,
+  PCM_TTY_SHM_RING_SIZE = 1<<16,
+  PCM_TTY_SHM_PLAYBACK_RING = PCM_TTY_SHM_PAGE,
+  PCM_TTY_SHM_CAPTURE_RING = PCM_TTY_SHM_PLAYBACK_RING + PCM_TTY_SHM_PAGE + PCM_TTY_SHM_RING_SIZE,
+  PCM_TTY_SHM_SIZE = PCM_TTY_SHM_CAPTURE_RING + PCM_TTY_SHM_PAGE + PCM_TTY_SHM_RING_SIZE
+};
+
+enum {
+  PCM_TTY_SHM_MAGIC = 0x50435454, // "PCTT"
+  PCM_TTY_SHM_VERSION = 3
+};
+
+enum pcm_tty_shm_state {
+  PCM_TTY_SHM_STATE_COMMAND,
+  PCM_TTY_SHM_STATE_VOICE
+};
+
+// Both rings are single producer single consumer, so there can only be one client per stream.
+// A client says which one it is by sending a single enum pcm_tty_shm_stream byte.
+enum pcm_tty_shm_stream {
+  PCM_TTY_SHM_STREAM_PLAYBACK,
+  PCM_TTY_SHM_STREAM_CAPTURE
+};
+
+// The daemon sets magic last, once everything else is valid.
+// Clients connect to the abstract unix socket named like the segment and send their stream.
+// The daemon answers with the version and an errno value, EBUSY if the stream is taken.
+// If that is 0, it passes two eventfds along: The daemon signals the first one on every
+// state change and whenever it moved audio, the second one is the doorbell of the daemon.
+struct pcm_tty_shm_control {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t size; // Of the whole segment
+  uint32_t state; // enum pcm_tty_shm_state, also a futex which is woken on every change
+  uint32_t seq; // Incremented on every state change
+  uint32_t playback_ring; // Offsets of the rings
+  uint32_t capture_ring;
+  uint32_t playback_drop; // Playback ring data before this position is to be discarded
+  uint32_t daemon_sleeping; // Ring the doorbell after adding playback audio while this is set
+  // Audio bytes in the kernel queues of the modem, without the DLE shielding.
+  // The daemon updates them whenever it wakes up, in voice mode that's at least whenever audio comes in.
+  uint32_t modem_outq;
+  uint32_t modem_inq;
+};
+
+static inline struct pcm_tty_ring* pcm_tty_shm_ring(void* shm, unsigned offset){
+  return (struct pcm_tty_ring*)((uint8_t*)shm + offset);
+}
+
+static inline void pcm_tty_shm_futex_wake(uint32_t* word){
+  syscall(SYS_futex, word, FUTEX_WAKE, INT_MAX, 0, 0, 0);
+}
+
+#endif
@@ -0,0 +1,76 @@
+// Copyright (c) 2019 Daniel Abrecht
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#ifndef PCM_TTY_STATS_H
+#define PCM_TTY_STATS_H
+
+#include <stdint.h>
+
+// Layout of the tty-pcm-stats:<pid>:<major>.<minor>:<playback|capture|daemon> shared memory segments.
+// With the stats option set, each plugin stream keeps one, and v253_splitter_daemon always keeps one
+// per modem. Others may only read them, pcm_tty_stats prints them.
+// Counters which don't apply to the owner of a segment just stay 0.
+
+#define PCM_TTY_STATS_COUNTERS \
+  X(bytes_written) \
+  X(bytes_read) \
+  X(short_writes) \
+  X(short_reads) \
+  X(eagain) \
+  X(overrun_bytes) /* Captured bytes lost because the ring was full */ \
+  X(playback_dropped) /* Playback bytes discarded when the stream was prepared again */ \
+  X(dle_inserted) \
+  X(dle_stripped) /* Including the DLE of events */ \
+  X(vtr_started) \
+  X(vtr_ended)
+
+// Histogram name, unit
+#define PCM_TTY_STATS_HISTOGRAMS \
+  X(queue_depth, "bytes") /* Data in the tty queue or ring, whenever the pointer is updated */ \
+  X(transfer_latency, "us") /* Time spent in the transfer callback */
+
+enum pcm_tty_stats_counter {
+#define X(NAME) PCM_TTY_STATS_ ## NAME,
+  PCM_TTY_STATS_COUNTERS
+#undef X
+  PCM_TTY_STATS_COUNTER_COUNT
+};
+
+enum pcm_tty_stats_histogram {
+#define X(NAME, UNIT) PCM_TTY_STATS_ ## NAME,
+  PCM_TTY_STATS_HISTOGRAMS
+#undef X
+  PCM_TTY_STATS_HISTOGRAM_COUNT
+};
+
+enum {
+  PCM_TTY_STATS_MAGIC = 0x50435453, // "PCTS"
+  PCM_TTY_STATS_VERSION = 1,
+  // Bucket 0 counts zeros, bucket n values from 2^(n-1) to 2^n-1, the last one everything above
+  PCM_TTY_STATS_BUCKETS = 24
+};
+
+struct pcm_tty_stats {
+  uint32_t magic;
+  uint32_t version;
+  uint64_t counter[PCM_TTY_STATS_COUNTER_COUNT];
+  uint64_t histogram[PCM_TTY_STATS_HISTOGRAM_COUNT][PCM_TTY_STATS_BUCKETS];
+};
+
+// Both may be called with a null pointer if there are no stats, and from any thread
+
+static inline void pcm_tty_stats_add(struct pcm_tty_stats* stats, enum pcm_tty_stats_counter counter, uint64_t n){
+  if(stats)
+    __atomic_fetch_add(&stats->counter[counter], n, __ATOMIC_RELAXED);
+}
+
+static inline void pcm_tty_stats_sample(struct pcm_tty_stats* stats, enum pcm_tty_stats_histogram histogram, uint64_t value){
+  if(!stats)
+    return;
+  unsigned bucket = value ? 64 - __builtin_clzll(value) : 0;
+  if(bucket >= PCM_TTY_STATS_BUCKETS)
+    bucket = PCM_TTY_STATS_BUCKETS - 1;
+  __atomic_fetch_add(&stats->histogram[histogram][bucket], 1, __ATOMIC_RELAXED);
+}
+
+#endif
@@ -0,0 +1,67 @@
+// Copyright (c) 2019 Daniel Abrecht
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#ifndef PCM_TTY_TRACE_H
+#define PCM_TTY_TRACE_H
+
+#include <stdint.h>
+
+// Layout of the tty-pcm-trace:<pid>:<major>.<minor>:<stream> shared memory segment.
+// With the trace option set, each stream records what its callbacks and io do there,
+// and pcm_tty_trace_dump decodes it, even while the stream is running.
+// The records are overwritten oldest first, so it always holds the recent past.
+
+// Event name, meaning of a, meaning of b
+#define PCM_TTY_TRACE_EVENTS \
+  X(prepare, 0, 0) \
+  X(start, 0, 0) \
+  X(stop, 0, 0) \
+  X(pointer, "position", "queued") \
+  X(delay, "delay", "queued") \
+  X(transfer, "offset", "size") \
+  X(transfer_done, "frames", "partial") \
+  X(short_io, "requested", "done") \
+  X(eagain, "requested", 0) \
+  X(overrun, "lost", 0) \
+  X(resample, "step_ppm", "line_rate")
+
+enum pcm_tty_trace_event {
+#define X(NAME, A, B) PCM_TTY_TRACE_ ## NAME,
+  PCM_TTY_TRACE_EVENTS
+#undef X
+  PCM_TTY_TRACE_EVENT_COUNT
+};
+
+enum {
+  PCM_TTY_TRACE_MAGIC = 0x50435452, // "PCTR"
+  PCM_TTY_TRACE_VERSION = 1,
+  PCM_TTY_TRACE_RECORDS = 4096 // Must be a power of two
+};
+
+// seq is the index of the record plus one. Writers zero it while they fill in the rest,
+// readers only trust a record if seq is what they expect before and after copying it.
+struct pcm_tty_trace_record {
+  uint32_t seq;
+  uint16_t event; // enum pcm_tty_trace_event
+  uint16_t reserved;
+  uint64_t time; // CLOCK_MONOTONIC ns
+  int64_t a;
+  int64_t b;
+};
+
+struct pcm_tty_trace {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t records; // Number of records
+  uint32_t rate; // Frames per second, 0 until the hw params are set
+  uint8_t pad0[48];
+  uint32_t head; // Index of the next record, any thread of the stream may advance it
+  uint8_t pad1[60];
+  struct pcm_tty_trace_record record[];
+};
+
+static inline uint64_t pcm_tty_trace_size(uint32_t records){
+  return sizeof(struct pcm_tty_trace) + (uint64_t)records * sizeof(struct pcm_tty_trace_record);
+}
+
+#endif
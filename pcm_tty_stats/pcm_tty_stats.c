@@ -0,0 +1,128 @@
+// Copyright (c) 2019 Daniel Abrecht
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <pcm_tty_stats.h>
+
+// Prints the counters the plugin streams and v253_splitter_daemon keep, see pcm_tty_stats.h
+
+static const char* const counter_name[] = {
+#define X(NAME) #NAME,
+  PCM_TTY_STATS_COUNTERS
+#undef X
+};
+
+static const char* const histogram_name[] = {
+#define X(NAME, UNIT) #NAME,
+  PCM_TTY_STATS_HISTOGRAMS
+#undef X
+};
+
+static const char* const histogram_unit[] = {
+#define X(NAME, UNIT) UNIT,
+  PCM_TTY_STATS_HISTOGRAMS
+#undef X
+};
+
+static const char prefix[] = "tty-pcm-stats:";
+
+static int print(const char* name){
+  int fd = shm_open(name, O_RDONLY, 0);
+  if(fd == -1){
+    fprintf(stderr, "shm_open %s failed: %s\n", name, strerror(errno));
+    return -1;
+  }
+  struct stat st;
+  if(fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof(struct pcm_tty_stats)){
+    fprintf(stderr, "%s: not a stats segment\n", name);
+    close(fd);
+    return -1;
+  }
+  const struct pcm_tty_stats* stats = mmap(0, sizeof(*stats), PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if(stats == MAP_FAILED){
+    fprintf(stderr, "mmap %s failed: %s\n", name, strerror(errno));
+    return -1;
+  }
+  int ret = -1;
+  if( __atomic_load_n(&stats->magic, __ATOMIC_ACQUIRE) != PCM_TTY_STATS_MAGIC
+   || stats->version != PCM_TTY_STATS_VERSION
+  ){
+    fprintf(stderr, "%s: unknown stats layout\n", name);
+    goto out;
+  }
+
+  printf("%s\n", name);
+  for(int i=0; i<PCM_TTY_STATS_COUNTER_COUNT; i++)
+    printf("  %-20s %"PRIu64"\n", counter_name[i], __atomic_load_n(&stats->counter[i], __ATOMIC_RELAXED));
+  for(int i=0; i<PCM_TTY_STATS_HISTOGRAM_COUNT; i++){
+    printf("  %s (%s)\n", histogram_name[i], histogram_unit[i]);
+    bool empty = true;
+    for(int b=0; b<PCM_TTY_STATS_BUCKETS; b++){
+      uint64_t count = __atomic_load_n(&stats->histogram[i][b], __ATOMIC_RELAXED);
+      if(!count)
+        continue;
+      empty = false;
+      char range[48];
+      if(!b){
+        snprintf(range, sizeof(range), "0");
+      }else if(b == PCM_TTY_STATS_BUCKETS - 1){
+        snprintf(range, sizeof(range), "%"PRIu64" and more", UINT64_C(1) << (b - 1));
+      }else{
+        snprintf(range, sizeof(range), "%"PRIu64" - %"PRIu64, UINT64_C(1) << (b - 1), (UINT64_C(1) << b) - 1);
+      }
+      printf("    %-20s %"PRIu64"\n", range, count);
+    }
+    if(empty)
+      printf("    no samples\n");
+  }
+  ret = 0;
+
+out:
+  munmap((void*)stats, sizeof(*stats));
+  return ret;
+}
+
+int main(int argc, char* argv[]){
+  if(argc > 1 && argv[1][0] == '-'){
+    fprintf(stderr, "Usage: %s [%s<pid>:<major>.<minor>:<playback|capture|daemon>]...\nWithout arguments, all of them are printed.\n", argv[0], prefix);
+    return 1;
+  }
+  int ret = 0;
+  if(argc > 1){
+    for(int i=1; i<argc; i++)
+      if(print(argv[i]) < 0)
+        ret = 1;
+    return ret;
+  }
+  DIR* dir = opendir("/dev/shm");
+  if(!dir){
+    perror("opendir /dev/shm");
+    return 1;
+  }
+  bool found = false;
+  struct dirent* entry;
+  while((entry = readdir(dir))){
+    if(strncmp(entry->d_name, prefix, sizeof(prefix) - 1))
+      continue;
+    found = true;
+    if(print(entry->d_name) < 0)
+      ret = 1;
+  }
+  closedir(dir);
+  if(!found){
+    fprintf(stderr, "No stats found. Is v253_splitter_daemon running, or the stats option set?\n");
+    return 1;
+  }
+  return ret;
+}
@@ -0,0 +1,145 @@
+// Copyright (c) 2019 Daniel Abrecht
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <pcm_tty_trace.h>
+
+// Decodes the trace rings the plugin writes with the trace option set, see pcm_tty_trace.h
+
+static const char* const event_name[] = {
+#define X(NAME, A, B) #NAME,
+  PCM_TTY_TRACE_EVENTS
+#undef X
+};
+
+static const char* const event_a[] = {
+#define X(NAME, A, B) A,
+  PCM_TTY_TRACE_EVENTS
+#undef X
+};
+
+static const char* const event_b[] = {
+#define X(NAME, A, B) B,
+  PCM_TTY_TRACE_EVENTS
+#undef X
+};
+
+static const char prefix[] = "tty-pcm-trace:";
+
+static int dump(const char* name){
+  int fd = shm_open(name, O_RDONLY, 0);
+  if(fd == -1){
+    fprintf(stderr, "shm_open %s failed: %s\n", name, strerror(errno));
+    return -1;
+  }
+  struct stat st;
+  if(fstat(fd, &st) == -1 || (uint64_t)st.st_size < pcm_tty_trace_size(0)){
+    fprintf(stderr, "%s: not a trace\n", name);
+    close(fd);
+    return -1;
+  }
+  const struct pcm_tty_trace* trace = mmap(0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if(trace == MAP_FAILED){
+    fprintf(stderr, "mmap %s failed: %s\n", name, strerror(errno));
+    return -1;
+  }
+  int ret = -1;
+  uint32_t records = trace->records;
+  if( __atomic_load_n(&trace->magic, __ATOMIC_ACQUIRE) != PCM_TTY_TRACE_MAGIC
+   || trace->version != PCM_TTY_TRACE_VERSION
+   || !records || (records & (records - 1))
+   || pcm_tty_trace_size(records) > (uint64_t)st.st_size
+  ){
+    fprintf(stderr, "%s: unknown trace layout\n", name);
+    goto out;
+  }
+
+  uint32_t head = __atomic_load_n(&trace->head, __ATOMIC_ACQUIRE);
+  uint32_t count = head < records ? head : records;
+  printf("%s: %"PRIu32" Hz, %"PRIu32" of %"PRIu32" records\n", name, trace->rate, count, head);
+  // Copy them out first, the stream may still be running
+  struct pcm_tty_trace_record* copy = calloc(count ? count : 1, sizeof(*copy));
+  if(!copy){
+    perror("calloc");
+    goto out;
+  }
+  size_t n = 0;
+  for(uint32_t index = head - count; index != head; index++){
+    const struct pcm_tty_trace_record* record = &trace->record[index & (records - 1)];
+    uint32_t seq = __atomic_load_n(&record->seq, __ATOMIC_ACQUIRE);
+    if(seq != index + 1)
+      continue; // Being written or already overwritten
+    copy[n] = *record;
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if(__atomic_load_n(&record->seq, __ATOMIC_RELAXED) == seq)
+      n++;
+  }
+  // Times are relative to the newest record
+  uint64_t end = n ? copy[n-1].time : 0;
+  for(size_t i=0; i<n; i++){
+    const struct pcm_tty_trace_record* record = &copy[i];
+    double t = ((double)record->time - end) / 1e9;
+    if(record->event >= PCM_TTY_TRACE_EVENT_COUNT){
+      printf("%12.6f unknown(%u) %"PRId64" %"PRId64"\n", t, record->event, record->a, record->b);
+      continue;
+    }
+    printf("%12.6f %*s", t, event_a[record->event] ? -13 : 0, event_name[record->event]);
+    if(event_a[record->event])
+      printf(" %s=%"PRId64, event_a[record->event], record->a);
+    if(event_b[record->event])
+      printf(" %s=%"PRId64, event_b[record->event], record->b);
+    putchar('\n');
+  }
+  free(copy);
+  ret = 0;
+
+out:
+  munmap((void*)trace, st.st_size);
+  return ret;
+}
+
+int main(int argc, char* argv[]){
+  if(argc > 1 && argv[1][0] == '-'){
+    fprintf(stderr, "Usage: %s [%s<pid>:<major>.<minor>:<playback|capture>]...\nWithout arguments, all traces are dumped.\n", argv[0], prefix);
+    return 1;
+  }
+  int ret = 0;
+  if(argc > 1){
+    for(int i=1; i<argc; i++)
+      if(dump(argv[i]) < 0)
+        ret = 1;
+    return ret;
+  }
+  DIR* dir = opendir("/dev/shm");
+  if(!dir){
+    perror("opendir /dev/shm");
+    return 1;
+  }
+  bool found = false;
+  struct dirent* entry;
+  while((entry = readdir(dir))){
+    if(strncmp(entry->d_name, prefix, sizeof(prefix) - 1))
+      continue;
+    found = true;
+    if(dump(entry->d_name) < 0)
+      ret = 1;
+  }
+  closedir(dir);
+  if(!found){
+    fprintf(stderr, "No traces found, is the trace option set?\n");
+    return 1;
+  }
+  return ret;
+}
@@ -0,0 +1,45 @@
+// Copyright (c) 2019 Daniel Abrecht
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+// This file must not include termios.h, the libc and kernel definitions of struct termios conflict
+
+#include <asm/termbits.h>
+#include <sys/ioctl.h>
+#include <errno.h>
+
+int pcm_tty_set_baudrate(int fd, unsigned long in, unsigned long out){
+#ifdef TCGETS2
+  struct termios2 tio;
+  if(ioctl(fd, TCGETS2, &tio) == -1)
+    return -errno;
+  tio.c_cflag &= ~(CBAUD | (CBAUD << IBSHIFT));
+  tio.c_cflag |= BOTHER | (BOTHER << IBSHIFT);
+  tio.c_ispeed = in;
+  tio.c_ospeed = out;
+  if(ioctl(fd, TCSETS2, &tio) == -1)
+    return -errno;
+  return 0;
+#else
+  (void)fd;
+  (void)in;
+  (void)out;
+  return -ENOSYS;
+#endif
+}
+
+int pcm_tty_get_baudrate(int fd, unsigned long* in, unsigned long* out){
+#ifdef TCGETS2
+  // The driver stores the rates it actually applied here
+  struct termios2 tio;
+  if(ioctl(fd, TCGETS2, &tio) == -1)
+    return -errno;
+  *out = tio.c_ospeed;
+  *in = tio.c_ispeed ? tio.c_ispeed : tio.c_ospeed;
+  return 0;
+#else
+  (void)fd;
+  (void)in;
+  (void)out;
+  return -ENOSYS;
+#endif
+}
@@ -0,0 +1,457 @@
+// Copyright (c) 2019 Daniel Abrecht
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include <libasound_module_pcm_tty.h>
+
+#if defined(__x86_64__) || (defined(__i386__) && defined(__SSE2__))
+#define PCM_TTY_CONVERT_X86
+#include <immintrin.h>
+#elif defined(__ARM_NEON) || defined(__aarch64__)
+#define PCM_TTY_CONVERT_NEON
+#include <arm_neon.h>
+#endif
+
+// Everything is converted via signed 16 bit samples, which is more precision than any of the line formats have
+enum { CHUNK_SAMPLES = 256 };
+
+static uint8_t mu_law_encode_table[1<<14];
+static uint8_t a_law_encode_table[1<<13];
+static int16_t mu_law_decode_table[256];
+static int16_t a_law_decode_table[256];
+
+// G.711
+static uint8_t linear_to_mu_law(int16_t sample){
+  int x = sample;
+  uint8_t sign = x < 0 ? 0x80 : 0x00;
+  if(x < 0)
+    x = -x;
+  if(x > 32635)
+    x = 32635;
+  x += 0x84;
+  int exponent = 7;
+  for(int mask=0x4000; !(x & mask) && exponent; mask >>= 1)
+    exponent--;
+  return ~(sign | exponent << 4 | ((x >> (exponent + 3)) & 0x0F));
+}
+
+static int16_t mu_law_to_linear(uint8_t value){
+  value = ~value;
+  int x = (((value & 0x0F) << 3) + 0x84) << ((value & 0x70) >> 4);
+  return value & 0x80 ? 0x84 - x : x - 0x84;
+}
+
+static uint8_t linear_to_a_law(int16_t sample){
+  int x = sample;
+  uint8_t sign = 0x80;
+  if(x < 0){
+    x = -x - 1;
+    sign = 0;
+  }
+  x >>= 3;
+  int exponent = 0;
+  for(int i=x>>5; i; i >>= 1)
+    exponent++;
+  if(exponent > 7)
+    return (sign | 0x7F) ^ 0x55;
+  uint8_t mantissa = (x >> (exponent < 2 ? 1 : exponent)) & 0x0F;
+  return (sign | exponent << 4 | mantissa) ^ 0x55;
+}
+
+static int16_t a_law_to_linear(uint8_t value){
+  value ^= 0x55;
+  int exponent = (value & 0x70) >> 4;
+  int x = (value & 0x0F) << 4 | 8;
+  if(exponent)
+    x = (x | 0x100) << (exponent - 1);
+  return value & 0x80 ? x : -x;
+}
+
+/* App format to s16 */
+
+static void s16_from_u8(int16_t* dst, const void* src, size_t count){
+  const uint8_t* s = src;
+  for(size_t i=0; i<count; i++)
+    dst[i] = (int16_t)((s[i] ^ 0x80) << 8);
+}
+
+static void s16_from_s8(int16_t* dst, const void* src, size_t count){
+  const int8_t* s = src;
+  for(size_t i=0; i<count; i++)
+    dst[i] = (int16_t)(s[i] * 256);
+}
+
+static void s16_from_s32_scalar(int16_t* dst, const void* src, size_t count){
+  const int32_t* s = src;
+  for(size_t i=0; i<count; i++)
+    dst[i] = s[i] >> 16;
+}
+
+static void s16_from_float_scalar(int16_t* dst, const void* src, size_t count){
+  const float* s = src;
+  for(size_t i=0; i<count; i++){
+    float x = s[i] * 32768.0f;
+    if(!(x > -32768.0f)) // Also catches NaN
+      x = -32768.0f;
+    if(x > 32767.0f)
+      x = 32767.0f;
+    // Half to even, like the SIMD conversions in the default rounding mode.
+    // The fraction is exact, there are only 15 bits left of the point.
+    int32_t r = (int32_t)x;
+    float frac = x - r;
+    if(frac > 0.5f || (frac == 0.5f && (r & 1)))
+      r++;
+    else if(frac < -0.5f || (frac == -0.5f && (r & 1)))
+      r--;
+    dst[i] = r;
+  }
+}
+
+/* s16 to app format */
+
+static void s16_to_u8(void* dst, const int16_t* src, size_t count){
+  uint8_t* d = dst;
+  for(size_t i=0; i<count; i++)
+    d[i] = (src[i] >> 8) ^ 0x80;
+}
+
+static void s16_to_s8(void* dst, const int16_t* src, size_t count){
+  int8_t* d = dst;
+  for(size_t i=0; i<count; i++)
+    d[i] = src[i] >> 8;
+}
+
+static void s16_to_s32(void* dst, const int16_t* src, size_t count){
+  int32_t* d = dst;
+  for(size_t i=0; i<count; i++)
+    d[i] = (int32_t)src[i] * 65536;
+}
+
+static void s16_to_float(void* dst, const int16_t* src, size_t count){
+  float* d = dst;
+  for(size_t i=0; i<count; i++)
+    d[i] = src[i] * (1.0f / 32768.0f);
+}
+
+/* s16 to line format */
+
+static void line_u8_from_s16_scalar(uint8_t* dst, const int16_t* src, size_t count){
+  s16_to_u8(dst, src, count);
+}
+
+static void line_s8_from_s16_scalar(uint8_t* dst, const int16_t* src, size_t count){
+  s16_to_s8(dst, src, count);
+}
+
+static void line_mu_law_from_s16(uint8_t* dst, const int16_t* src, size_t count){
+  for(size_t i=0; i<count; i++)
+    dst[i] = mu_law_encode_table[(uint16_t)src[i] >> 2];
+}
+
+static void line_a_law_from_s16(uint8_t* dst, const int16_t* src, size_t count){
+  for(size_t i=0; i<count; i++)
+    dst[i] = a_law_encode_table[(uint16_t)src[i] >> 3];
+}
+
+/* line format to s16 */
+
+static void line_u8_to_s16(int16_t* dst, const uint8_t* src, size_t count){
+  s16_from_u8(dst, src, count);
+}
+
+static void line_s8_to_s16(int16_t* dst, const uint8_t* src, size_t count){
+  s16_from_s8(dst, src, count);
+}
+
+static void line_mu_law_to_s16(int16_t* dst, const uint8_t* src, size_t count){
+  for(size_t i=0; i<count; i++)
+    dst[i] = mu_law_decode_table[src[i]];
+}
+
+static void line_a_law_to_s16(int16_t* dst, const uint8_t* src, size_t count){
+  for(size_t i=0; i<count; i++)
+    dst[i] = a_law_decode_table[src[i]];
+}
+
+#ifdef PCM_TTY_CONVERT_X86
+static void s16_from_s32_sse2(int16_t* dst, const void* src, size_t count){
+  const int32_t* s = src;
+  size_t i = 0;
+  for(; i+8 <= count; i += 8){
+    __m128i a = _mm_srai_epi32(_mm_loadu_si128((const __m128i*)(s+i)), 16);
+    __m128i b = _mm_srai_epi32(_mm_loadu_si128((const __m128i*)(s+i+4)), 16);
+    _mm_storeu_si128((__m128i*)(dst+i), _mm_packs_epi32(a, b));
+  }
+  s16_from_s32_scalar(dst+i, s+i, count-i);
+}
+
+static inline __m128i float_to_s32_sse2(const float* s){
+  __m128 x = _mm_loadu_ps(s);
+  x = _mm_min_ps(_mm_max_ps(x, _mm_set1_ps(-1.0f)), _mm_set1_ps(1.0f));
+  return _mm_cvtps_epi32(_mm_mul_ps(x, _mm_set1_ps(32768.0f)));
+}
+
+static void s16_from_float_sse2(int16_t* dst, const void* src, size_t count){
+  const float* s = src;
+  size_t i = 0;
+  for(; i+8 <= count; i += 8)
+    _mm_storeu_si128((__m128i*)(dst+i), _mm_packs_epi32(float_to_s32_sse2(s+i), float_to_s32_sse2(s+i+4)));
+  s16_from_float_scalar(dst+i, s+i, count-i);
+}
+
+static void line_s8_from_s16_sse2(uint8_t* dst, const int16_t* src, size_t count){
+  size_t i = 0;
+  for(; i+16 <= count; i += 16){
+    __m128i a = _mm_srai_epi16(_mm_loadu_si128((const __m128i*)(src+i)), 8);
+    __m128i b = _mm_srai_epi16(_mm_loadu_si128((const __m128i*)(src+i+8)), 8);
+    _mm_storeu_si128((__m128i*)(dst+i), _mm_packs_epi16(a, b));
+  }
+  line_s8_from_s16_scalar(dst+i, src+i, count-i);
+}
+
+static void line_u8_from_s16_sse2(uint8_t* dst, const int16_t* src, size_t count){
+  const __m128i bias = _mm_set1_epi8((char)0x80);
+  size_t i = 0;
+  for(; i+16 <= count; i += 16){
+    __m128i a = _mm_srai_epi16(_mm_loadu_si128((const __m128i*)(src+i)), 8);
+    __m128i b = _mm_srai_epi16(_mm_loadu_si128((const __m128i*)(src+i+8)), 8);
+    _mm_storeu_si128((__m128i*)(dst+i), _mm_xor_si128(_mm_packs_epi16(a, b), bias));
+  }
+  line_u8_from_s16_scalar(dst+i, src+i, count-i);
+}
+
+// packs works within 128 bit lanes, the permute puts the results back in order
+__attribute__((target("avx2")))
+static void s16_from_float_avx2(int16_t* dst, const void* src, size_t count){
+  const float* s = src;
+  const __m256 lo = _mm256_set1_ps(-1.0f), hi = _mm256_set1_ps(1.0f), scale = _mm256_set1_ps(32768.0f);
+  size_t i = 0;
+  for(; i+16 <= count; i += 16){
+    __m256 x = _mm256_min_ps(_mm256_max_ps(_mm256_loadu_ps(s+i), lo), hi);
+    __m256 y = _mm256_min_ps(_mm256_max_ps(_mm256_loadu_ps(s+i+8), lo), hi);
+    __m256i a = _mm256_cvtps_epi32(_mm256_mul_ps(x, scale));
+    __m256i b = _mm256_cvtps_epi32(_mm256_mul_ps(y, scale));
+    _mm256_storeu_si256((__m256i*)(dst+i), _mm256_permute4x64_epi64(_mm256_packs_epi32(a, b), 0xD8));
+  }
+  s16_from_float_sse2(dst+i, s+i, count-i);
+}
+
+__attribute__((target("avx2")))
+static void line_u8_from_s16_avx2(uint8_t* dst, const int16_t* src, size_t count){
+  const __m256i bias = _mm256_set1_epi8((char)0x80);
+  size_t i = 0;
+  for(; i+32 <= count; i += 32){
+    __m256i a = _mm256_srai_epi16(_mm256_loadu_si256((const __m256i*)(src+i)), 8);
+    __m256i b = _mm256_srai_epi16(_mm256_loadu_si256((const __m256i*)(src+i+16)), 8);
+    __m256i r = _mm256_permute4x64_epi64(_mm256_packs_epi16(a, b), 0xD8);
+    _mm256_storeu_si256((__m256i*)(dst+i), _mm256_xor_si256(r, bias));
+  }
+  line_u8_from_s16_sse2(dst+i, src+i, count-i);
+}
+
+__attribute__((target("avx2")))
+static void line_s8_from_s16_avx2(uint8_t* dst, const int16_t* src, size_t count){
+  size_t i = 0;
+  for(; i+32 <= count; i += 32){
+    __m256i a = _mm256_srai_epi16(_mm256_loadu_si256((const __m256i*)(src+i)), 8);
+    __m256i b = _mm256_srai_epi16(_mm256_loadu_si256((const __m256i*)(src+i+16)), 8);
+    _mm256_storeu_si256((__m256i*)(dst+i), _mm256_permute4x64_epi64(_mm256_packs_epi16(a, b), 0xD8));
+  }
+  line_s8_from_s16_sse2(dst+i, src+i, count-i);
+}
+#endif
+
+#ifdef PCM_TTY_CONVERT_NEON
+static void s16_from_s32_neon(int16_t* dst, const void* src, size_t count){
+  const int32_t* s = src;
+  size_t i = 0;
+  for(; i+8 <= count; i += 8)
+    vst1q_s16(dst+i, vcombine_s16(vshrn_n_s32(vld1q_s32(s+i), 16), vshrn_n_s32(vld1q_s32(s+i+4), 16)));
+  s16_from_s32_scalar(dst+i, s+i, count-i);
+}
+
+static inline int16x4_t float_to_s16_neon(const float* s){
+  float32x4_t x = vld1q_f32(s);
+  // NaN becomes -1, like in the scalar version
+  x = vbslq_f32(vceqq_f32(x, x), x, vdupq_n_f32(-1.0f));
+  x = vmulq_n_f32(vminq_f32(vmaxq_f32(x, vdupq_n_f32(-1.0f)), vdupq_n_f32(1.0f)), 32768.0f);
+#ifdef __aarch64__
+  int32x4_t r = vcvtnq_s32_f32(x); // Half to even
+#else
+  // vcvtq truncates. Adding 1.5 * 2^23 leaves no bits right of the point, so that rounds half to even first.
+  x = vsubq_f32(vaddq_f32(x, vdupq_n_f32(12582912.0f)), vdupq_n_f32(12582912.0f));
+  int32x4_t r = vcvtq_s32_f32(x);
+#endif
+  return vqmovn_s32(r);
+}
+
+static void s16_from_float_neon(int16_t* dst, const void* src, size_t count){
+  const float* s = src;
+  size_t i = 0;
+  for(; i+8 <= count; i += 8)
+    vst1q_s16(dst+i, vcombine_s16(float_to_s16_neon(s+i), float_to_s16_neon(s+i+4)));
+  s16_from_float_scalar(dst+i, s+i, count-i);
+}
+
+static void line_s8_from_s16_neon(uint8_t* dst, const int16_t* src, size_t count){
+  size_t i = 0;
+  for(; i+8 <= count; i += 8)
+    vst1_s8((int8_t*)dst+i, vshrn_n_s16(vld1q_s16(src+i), 8));
+  line_s8_from_s16_scalar(dst+i, src+i, count-i);
+}
+
+static void line_u8_from_s16_neon(uint8_t* dst, const int16_t* src, size_t count){
+  size_t i = 0;
+  for(; i+8 <= count; i += 8)
+    vst1_u8(dst+i, veor_u8(vreinterpret_u8_s8(vshrn_n_s16(vld1q_s16(src+i), 8)), vdup_n_u8(0x80)));
+  line_u8_from_s16_scalar(dst+i, src+i, count-i);
+}
+#endif
+
+static void (*s16_from_s32)(int16_t* dst, const void* src, size_t count) = s16_from_s32_scalar;
+static void (*s16_from_float)(int16_t* dst, const void* src, size_t count) = s16_from_float_scalar;
+static void (*line_u8_from_s16)(uint8_t* dst, const int16_t* src, size_t count) = line_u8_from_s16_scalar;
+static void (*line_s8_from_s16)(uint8_t* dst, const int16_t* src, size_t count) = line_s8_from_s16_scalar;
+
+static void pcm_tty_convert_setup(void) __attribute__((constructor,used));
+static void pcm_tty_convert_setup(void){
+  for(size_t i=0; i<sizeof(mu_law_encode_table); i++)
+    mu_law_encode_table[i] = linear_to_mu_law((int16_t)(i << 2));
+  for(size_t i=0; i<sizeof(a_law_encode_table); i++)
+    a_law_encode_table[i] = linear_to_a_law((int16_t)(i << 3));
+  for(int i=0; i<256; i++){
+    mu_law_decode_table[i] = mu_law_to_linear(i);
+    a_law_decode_table[i] = a_law_to_linear(i);
+  }
+#if defined(PCM_TTY_CONVERT_X86)
+  __builtin_cpu_init();
+  s16_from_s32 = s16_from_s32_sse2;
+  if(__builtin_cpu_supports("avx2")){
+    s16_from_float = s16_from_float_avx2;
+    line_u8_from_s16 = line_u8_from_s16_avx2;
+    line_s8_from_s16 = line_s8_from_s16_avx2;
+  }else{
+    s16_from_float = s16_from_float_sse2;
+    line_u8_from_s16 = line_u8_from_s16_sse2;
+    line_s8_from_s16 = line_s8_from_s16_sse2;
+  }
+#elif defined(PCM_TTY_CONVERT_NEON)
+  s16_from_s32 = s16_from_s32_neon;
+  s16_from_float = s16_from_float_neon;
+  line_u8_from_s16 = line_u8_from_s16_neon;
+  line_s8_from_s16 = line_s8_from_s16_neon;
+#endif
+}
+
+static void s16_from_s32_dispatch(int16_t* dst, const void* src, size_t count){
+  s16_from_s32(dst, src, count);
+}
+
+static void s16_from_float_dispatch(int16_t* dst, const void* src, size_t count){
+  s16_from_float(dst, src, count);
+}
+
+static void line_u8_from_s16_dispatch(uint8_t* dst, const int16_t* src, size_t count){
+  line_u8_from_s16(dst, src, count);
+}
+
+static void line_s8_from_s16_dispatch(uint8_t* dst, const int16_t* src, size_t count){
+  line_s8_from_s16(dst, src, count);
+}
+
+static const struct {
+  snd_pcm_format_t format;
+  size_t bytes;
+  void (*to_s16)(int16_t* dst, const void* src, size_t count);
+  void (*from_s16)(void* dst, const int16_t* src, size_t count);
+} app_formats[] = {
+  { SND_PCM_FORMAT_S16,   2, 0, 0 },
+  { SND_PCM_FORMAT_FLOAT, 4, s16_from_float_dispatch, s16_to_float },
+  { SND_PCM_FORMAT_S32,   4, s16_from_s32_dispatch, s16_to_s32 },
+  { SND_PCM_FORMAT_U8,    1, s16_from_u8, s16_to_u8 },
+  { SND_PCM_FORMAT_S8,    1, s16_from_s8, s16_to_s8 },
+};
+
+static const struct {
+  snd_pcm_format_t format;
+  void (*from_s16)(uint8_t* dst, const int16_t* src, size_t count);
+  void (*to_s16)(int16_t* dst, const uint8_t* src, size_t count);
+} line_formats[] = {
+  { SND_PCM_FORMAT_U8,     line_u8_from_s16_dispatch, line_u8_to_s16 },
+  { SND_PCM_FORMAT_S8,     line_s8_from_s16_dispatch, line_s8_to_s16 },
+  { SND_PCM_FORMAT_MU_LAW, line_mu_law_from_s16, line_mu_law_to_s16 },
+  { SND_PCM_FORMAT_A_LAW,  line_a_law_from_s16, line_a_law_to_s16 },
+};
+
+#define COUNT(X) (sizeof(X) / sizeof(*(X)))
+
+size_t pcm_tty_convert_formats(snd_pcm_format_t line, unsigned formats[], size_t max){
+  size_t n = 0;
+  if(n < max)
+    formats[n++] = line;
+  bool convertible = false;
+  for(size_t i=0; i<COUNT(line_formats); i++)
+    if(line_formats[i].format == line)
+      convertible = true;
+  if(!convertible)
+    return n;
+  for(size_t i=0; i<COUNT(app_formats) && n<max; i++)
+    if(app_formats[i].format != line)
+      formats[n++] = app_formats[i].format;
+  return n;
+}
+
+// With via_s16, the converters are set up even if the formats are the same, for the resampler
+int pcm_tty_convert_init(struct pcm_tty_convert* convert, snd_pcm_format_t app, snd_pcm_format_t line, bool via_s16){
+  memset(convert, 0, sizeof(*convert));
+  if(app == line && !via_s16)
+    return 0;
+  size_t a = 0, l = 0;
+  while(a < COUNT(app_formats) && app_formats[a].format != app)
+    a++;
+  while(l < COUNT(line_formats) && line_formats[l].format != line)
+    l++;
+  if(a == COUNT(app_formats) || l == COUNT(line_formats))
+    return -EINVAL;
+  convert->active = app != line;
+  convert->app_bytes = app_formats[a].bytes;
+  convert->app_to_s16 = app_formats[a].to_s16;
+  convert->s16_to_app = app_formats[a].from_s16;
+  convert->s16_to_line = line_formats[l].from_s16;
+  convert->line_to_s16 = line_formats[l].to_s16;
+  return 0;
+}
+
+void pcm_tty_encode(const struct pcm_tty_convert* convert, uint8_t* dst, const void* src, size_t count){
+  if(!convert->app_to_s16){
+    convert->s16_to_line(dst, src, count);
+    return;
+  }
+  int16_t tmp[CHUNK_SAMPLES];
+  const uint8_t* s = src;
+  while(count){
+    size_t n = count < CHUNK_SAMPLES ? count : CHUNK_SAMPLES;
+    convert->app_to_s16(tmp, s, n);
+    convert->s16_to_line(dst, tmp, n);
+    s += n * convert->app_bytes;
+    dst += n;
+    count -= n;
+  }
+}
+
+void pcm_tty_decode(const struct pcm_tty_convert* convert, void* dst, const uint8_t* src, size_t count){
+  if(!convert->s16_to_app){
+    convert->line_to_s16(dst, src, count);
+    return;
+  }
+  // Each chunk is read completely before it's written, which is what makes decoding in place possible
+  int16_t tmp[CHUNK_SAMPLES];
+  uint8_t* d = dst;
+  while(count){
+    size_t n = count < CHUNK_SAMPLES ? count : CHUNK_SAMPLES;
+    convert->line_to_s16(tmp, src, n);
+    convert->s16_to_app(d, tmp, n);
+    d += n * convert->app_bytes;
+    src += n;
+    count -= n;
+  }
+}
@@ -0,0 +1,142 @@
+// Copyright (c) 2019 Daniel Abrecht
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include <pcm_tty_dle.h>
+
+#include <string.h>
+
+#if defined(__x86_64__) || (defined(__i386__) && defined(__SSE2__))
+#define PCM_TTY_DLE_X86
+#include <immintrin.h>
+#elif defined(__ARM_NEON) || defined(__aarch64__)
+#define PCM_TTY_DLE_NEON
+#include <arm_neon.h>
+#endif
+
+static size_t dle_find_scalar(const uint8_t* data, size_t size){
+  const uint8_t* res = memchr(data, C_DLE, size);
+  return res ? (size_t)(res - data) : size;
+}
+
+#ifdef PCM_TTY_DLE_X86
+static size_t dle_find_sse2(const uint8_t* data, size_t size){
+  const __m128i dle = _mm_set1_epi8(C_DLE);
+  size_t i = 0;
+  for(; i+16 <= size; i += 16){
+    unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(data+i)), dle));
+    if(mask)
+      return i + __builtin_ctz(mask);
+  }
+  return i + dle_find_scalar(data+i, size-i);
+}
+
+__attribute__((target("avx2")))
+static size_t dle_find_avx2(const uint8_t* data, size_t size){
+  const __m256i dle = _mm256_set1_epi8(C_DLE);
+  size_t i = 0;
+  for(; i+32 <= size; i += 32){
+    unsigned mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(data+i)), dle));
+    if(mask)
+      return i + __builtin_ctz(mask);
+  }
+  return i + dle_find_sse2(data+i, size-i);
+}
+#endif
+
+#ifdef PCM_TTY_DLE_NEON
+static size_t dle_find_neon(const uint8_t* data, size_t size){
+  const uint8x16_t dle = vdupq_n_u8(C_DLE);
+  size_t i = 0;
+  for(; i+16 <= size; i += 16){
+    uint64x2_t mask = vreinterpretq_u64_u8(vceqq_u8(vld1q_u8(data+i), dle));
+    uint64_t lo = vgetq_lane_u64(mask, 0);
+    uint64_t hi = vgetq_lane_u64(mask, 1);
+    if(lo)
+      return i + __builtin_ctzll(lo) / 8;
+    if(hi)
+      return i + 8 + __builtin_ctzll(hi) / 8;
+  }
+  return i + dle_find_scalar(data+i, size-i);
+}
+#endif
+
+size_t (*pcm_tty_dle_find)(const uint8_t* data, size_t size) = dle_find_scalar;
+
+static void pcm_tty_dle_init(void) __attribute__((constructor,used));
+static void pcm_tty_dle_init(void){
+#if defined(PCM_TTY_DLE_X86)
+  __builtin_cpu_init();
+  if(__builtin_cpu_supports("avx2")){
+    pcm_tty_dle_find = dle_find_avx2;
+  }else{
+    pcm_tty_dle_find = dle_find_sse2;
+  }
+#elif defined(PCM_TTY_DLE_NEON)
+  pcm_tty_dle_find = dle_find_neon;
+#endif
+}
+
+size_t pcm_tty_dle_shield(uint8_t*restrict dst, size_t dst_size, const uint8_t*restrict src, size_t* src_size){
+  size_t i = 0, m = 0, size = *src_size;
+  while(i < size && m < dst_size){
+    size_t n = size - i < dst_size - m ? size - i : dst_size - m;
+    n = pcm_tty_dle_find(src+i, n);
+    memcpy(dst+m, src+i, n);
+    i += n;
+    m += n;
+    if(i >= size || m >= dst_size)
+      break;
+    // src[i] is a DLE, it needs to be doubled
+    if(dst_size - m < 2)
+      break;
+    dst[m++] = C_DLE;
+    dst[m++] = C_DLE;
+    i++;
+  }
+  *src_size = i;
+  return m;
+}
+
+static void v253_event_push(struct pcm_tty_v253_decoder* d, uint8_t event){
+  unsigned w = d->event_write;
+  if(w - __atomic_load_n(&d->event_read, __ATOMIC_ACQUIRE) >= PCM_TTY_V253_EVENT_QUEUE_SIZE)
+    return; // Nobody is picking them up, drop the newest one
+  d->event[w % PCM_TTY_V253_EVENT_QUEUE_SIZE] = event;
+  __atomic_store_n(&d->event_write, w+1, __ATOMIC_RELEASE);
+}
+
+int pcm_tty_v253_event_pop(struct pcm_tty_v253_decoder* d){
+  unsigned r = d->event_read;
+  if(r == __atomic_load_n(&d->event_write, __ATOMIC_ACQUIRE))
+    return -1;
+  int event = d->event[r % PCM_TTY_V253_EVENT_QUEUE_SIZE];
+  __atomic_store_n(&d->event_read, r+1, __ATOMIC_RELEASE);
+  return event;
+}
+
+size_t pcm_tty_v253_decode(struct pcm_tty_v253_decoder* d, uint8_t* dst, const uint8_t* src, size_t size){
+  uint8_t* start = dst;
+  const uint8_t* end = src + size;
+  while(src < end){
+    if(d->dle){
+      uint8_t c = *src++;
+      d->dle = false;
+      switch(c){
+        case C_DLE: *dst++ = C_DLE; break;
+        case C_SUB: *dst++ = C_DLE; *dst++ = C_DLE; break;
+        default: v253_event_push(d, c); break;
+      }
+      continue;
+    }
+    size_t n = pcm_tty_dle_find(src, end - src);
+    if(dst != src)
+      memmove(dst, src, n);
+    dst += n;
+    src += n;
+    if(src < end){
+      d->dle = true;
+      src++;
+    }
+  }
+  return dst - start;
+}
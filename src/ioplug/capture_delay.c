@@ -0,0 +1,21 @@
+// Copyright (c) 2019 Daniel Abrecht
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include <libasound_module_pcm_tty.h>
+
+
+CALLBACK( capture, int, delay, (snd_pcm_ioplug_t *io, snd_pcm_sframes_t *delayp) ){
+  struct tty_snd_plug* tty = io->private_data;
+  // Updates virtual_offset, which counts the frames taken from the tty
+  if(tty->ring)
+    io->callback->pointer(io);
+  int available = pcm_tty_queued(tty);
+  // Frames not read by the application yet, plus the time it took to receive what's still in the tty and the resampler
+  *delayp = snd_pcm_ioplug_avail(io, tty->virtual_offset, io->appl_ptr) + pcm_tty_line_delay(tty, available + tty->resampler.pending * tty->frame_bytes);
+  // If nothing came in since the last read, the newest frame is as old as that read.
+  // ALSA stamps the status with CLOCK_MONOTONIC when it asks, so this is what makes the delay match the timestamp.
+  if(!available)
+    *delayp += pcm_tty_since_arrival(tty);
+  pcm_tty_trace(tty, PCM_TTY_TRACE_delay, *delayp, available);
+  return 0;
+}
@@ -3,15 +3,47 @@
 
 #include <libasound_module_pcm_tty.h>
 
-#include <sys/ioctl.h>
-#include <termios.h>
-
 
 CALLBACK( capture, snd_pcm_sframes_t, pointer, (snd_pcm_ioplug_t *io) ){
   struct tty_snd_plug* tty = io->private_data;
-  int available = 0;
-  if(ioctl(tty->device_fd, TIOCINQ, &available) == -1 || available < 0)
-    available = 0;
-  m_debug("capture_pointer %ld + %d = %ld\n", tty->virtual_offset, available, tty->virtual_offset + available );
-  return tty->virtual_offset + available;
+  // The reader thread lost the tty
+  int error = pcm_tty_thread_error(tty);
+  if(error)
+    return error;
+  if(tty->uring){
+    error = pcm_tty_uring_update(tty);
+    if(error < 0)
+      return error;
+  }
+  if(tty->ring){
+    // Everything the reader thread or io_uring has put into the ring is available
+    uint32_t position = pcm_tty_ring_write_position(tty->ring);
+    int32_t received = position - tty->ring_position;
+    // Only count whole frames, the rest of an incomplete one is counted once it's complete
+    if(received >= (int32_t)tty->frame_bytes){
+      snd_pcm_sframes_t frames = received / tty->frame_bytes;
+      tty->virtual_offset += frames;
+      tty->ring_position += frames * tty->frame_bytes;
+      // v253_splitter_daemon doesn't say when it got the data, this is the closest there is
+      if(tty->shm)
+        pcm_tty_arrived(tty);
+    }
+    uint32_t fill = pcm_tty_ring_fill(tty->ring);
+    pcm_tty_stats_sample(tty->stats, PCM_TTY_STATS_queue_depth, fill);
+    pcm_tty_trace(tty, PCM_TTY_TRACE_pointer, tty->virtual_offset, fill);
+    return tty->virtual_offset;
+  }
+  int available = pcm_tty_queued(tty);
+  // Together with what's left of an incomplete frame, these are whole frames ready to be read
+  snd_pcm_sframes_t frames = (tty->partial + available) / tty->frame_bytes;
+  if(tty->resampler.active){
+    pcm_tty_resample_update(tty, available);
+    // The last of them is needed to interpolate up to it, so don't promise it
+    frames = pcm_tty_resample_app_frames(tty, tty->resampler.pending + frames);
+    if(frames)
+      frames--;
+  }
+  pcm_tty_stats_sample(tty->stats, PCM_TTY_STATS_queue_depth, available);
+  pcm_tty_trace(tty, PCM_TTY_TRACE_pointer, tty->virtual_offset + frames, available);
+  return tty->virtual_offset + frames;
 }
@@ -0,0 +1,20 @@
+// Copyright (c) 2019 Daniel Abrecht
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include <libasound_module_pcm_tty.h>
+
+
+CALLBACK( capture, int, prepare, (snd_pcm_ioplug_t *io) ){
+  m_debug("capture_prepare\n");
+  struct tty_snd_plug* tty = io->private_data;
+  pcm_tty_trace(tty, PCM_TTY_TRACE_prepare, 0, 0);
+  tty->virtual_offset = 0;
+  tty->last_pointer = 0;
+  tty->partial = 0;
+  tty->arrival = 0;
+  if(tty->resampler.active)
+    pcm_tty_resample_reset(tty);
+  if(tty->ring)
+    tty->ring_position = pcm_tty_ring_write_position(tty->ring);
+  return pcm_tty_timer_arm(tty);
+}
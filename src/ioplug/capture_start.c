@@ -5,7 +5,14 @@
 
 
 CALLBACK( capture, int, start, (snd_pcm_ioplug_t *io) ){
-  (void)io;
   m_debug("capture_start\n");
+  struct tty_snd_plug* tty = io->private_data;
+  pcm_tty_trace(tty, PCM_TTY_TRACE_start, 0, 0);
+  if(tty->ring){
+    // Only what arrives from now on belongs to the stream
+    uint32_t position = pcm_tty_ring_write_position(tty->ring);
+    pcm_tty_ring_consume(tty->ring, position - pcm_tty_ring_read_position(tty->ring));
+    tty->ring_position = position;
+  }
   return 0;
 }
@@ -2,56 +2,99 @@
 // SPDX-License-Identifier: GPL-3.0-or-later
 
 #include <stdint.h>
+#include <string.h>
 
 #include <libasound_module_pcm_tty.h>
 
-
-CALLBACK( capture,
-  snd_pcm_sframes_t, transfer, (
-    snd_pcm_ioplug_t *io,
-    const snd_pcm_channel_area_t *areas,
-    snd_pcm_uframes_t offset,
-    snd_pcm_uframes_t size
-  )
-){
-  m_debug("capture_transfer: %ld %ld\n", offset, size);
-  struct tty_snd_plug* tty = io->private_data;
-  ssize_t s, os=size;
-  for( unsigned channel=0; channel<io->channels; channel++){
-    uint8_t* data_start = (uint8_t*)areas[channel].addr + areas[channel].first / 8;
-    if(tty->settings.mode == PCM_TTY_MODE_v253){
-      if(tty->shm[0]){
-        bool skip = false;
-        while(os && (s=read(tty->device_fd, data_start, os))>0){
-          uint8_t* rof = data_start;
-          while(s){
-            if(skip && (*rof != C_DLE || *rof != C_SUB)){
-              skip = false;
-              --s;
-              ++rof;
-              continue;
-            }
-            if(rof[0] == C_DLE){
-              ++rof;
-              --s;
-              skip = true;
-              continue;
-            }
-            --s;
-            --os;
-            *(data_start++) = *(rof++);
-          }
-        }
-      }
-    }else{
-      while(os && (s=read(tty->device_fd, data_start, os))>0){
-        os -= s;
-        data_start += s;
-      }
-    }
-    break; // TODO: Extend if more channels are some day needed
+// Reads data in the line format from the tty, returns how much was read
+static size_t capture_read(struct tty_snd_plug* tty, uint8_t* data_start, size_t size){
+  ssize_t s, os = size;
+  while(os && (s=read(tty->device_fd, data_start, os))>0){
+    os -= s;
+    data_start += s;
+  }
+  pcm_tty_stats_add(tty->stats, PCM_TTY_STATS_bytes_read, size - os);
+  if(os){
+    pcm_tty_stats_add(tty->stats, PCM_TTY_STATS_short_reads, 1);
+    pcm_tty_trace(tty, PCM_TTY_TRACE_short_io, size, size - os);
   }
-  tty->virtual_offset += size - os;
-  m_debug("%zd\n", size - os);
   return size - os;
 }
+
+// The line format data goes to the end of the area, where it can be converted in place
+static inline uint8_t* line_start(struct tty_snd_plug* tty, uint8_t* data_start, snd_pcm_uframes_t size){
+  return data_start + size * (tty->app_frame_bytes - tty->frame_bytes);
+}
+
+static inline snd_pcm_sframes_t transfer_done(struct tty_snd_plug* tty, uint8_t* data_start, const uint8_t* line, size_t frames){
+  if(tty->convert.active)
+    pcm_tty_decode(&tty->convert, data_start, line, frames * tty->ioplug.channels);
+  pcm_tty_trace(tty, PCM_TTY_TRACE_transfer_done, frames, tty->partial);
+  return frames;
+}
+
+// The reader thread, io_uring or v253_splitter_daemon already did the rest.
+// The pointer only counts whole frames, so they are all there.
+static inline snd_pcm_sframes_t transfer_ring(struct tty_snd_plug* tty, uint8_t* data_start, snd_pcm_uframes_t size){
+  uint8_t* line = line_start(tty, data_start, size);
+  size_t frames = pcm_tty_ring_get(tty->ring, tty->ring_size, line, size * tty->frame_bytes) / tty->frame_bytes;
+  return transfer_done(tty, data_start, line, frames);
+}
+
+// With single byte frames, there is never an incomplete frame left over
+static inline snd_pcm_sframes_t transfer_direct(struct tty_snd_plug* tty, uint8_t* data_start, snd_pcm_uframes_t size, size_t frame_bytes){
+  uint8_t* line = line_start(tty, data_start, size);
+  size_t partial = frame_bytes > 1 ? tty->partial : 0;
+  // Continue the incomplete frame left over from last time
+  if(partial)
+    memcpy(line, tty->partial_frame, partial);
+  size_t s = capture_read(tty, line + partial, size * frame_bytes - partial);
+  if(s)
+    pcm_tty_arrived(tty);
+  size_t done = partial + s;
+  size_t frames = done / frame_bytes;
+  if(frame_bytes > 1){
+    // Keep the start of an incomplete frame for the next transfer, it may go elsewhere in the buffer
+    tty->partial = done % frame_bytes;
+    memcpy(tty->partial_frame, line + frames * frame_bytes, tty->partial);
+  }
+  tty->virtual_offset += frames;
+  return transfer_done(tty, data_start, line, frames);
+}
+
+// The resampler converts by itself
+static inline snd_pcm_sframes_t transfer_resample(struct tty_snd_plug* tty, uint8_t* data_start, snd_pcm_uframes_t size){
+  snd_pcm_sframes_t frames = pcm_tty_resample_read(tty, data_start, size);
+  tty->virtual_offset += frames;
+  pcm_tty_trace(tty, PCM_TTY_TRACE_transfer_done, frames, tty->resampler.pending);
+  return frames;
+}
+
+// Defines the transfer callback of a variant, see PCM_TTY_TRANSFER_VARIANTS. It's timed if there are stats.
+#define TRANSFER(VARIANT, CALL) \
+  CALLBACK( capture_ ## VARIANT, \
+    snd_pcm_sframes_t, transfer, ( \
+      snd_pcm_ioplug_t *io, \
+      const snd_pcm_channel_area_t *areas, \
+      snd_pcm_uframes_t offset, \
+      snd_pcm_uframes_t size \
+    ) \
+  ){ \
+    struct tty_snd_plug* tty = io->private_data; \
+    pcm_tty_trace(tty, PCM_TTY_TRACE_transfer, offset, size); \
+    /* The channels are interleaved, so all the data is in one block starting at the first channel */ \
+    uint8_t* data_start = (uint8_t*)areas[0].addr + (areas[0].first + offset * areas[0].step) / 8; \
+    if(!tty->stats) \
+      return CALL; \
+    uint64_t start = pcm_tty_now(); \
+    snd_pcm_sframes_t ret = CALL; \
+    pcm_tty_stats_sample(tty->stats, PCM_TTY_STATS_transfer_latency, (pcm_tty_now() - start) / 1000); \
+    return ret; \
+  }
+
+TRANSFER(direct, transfer_direct(tty, data_start, size, tty->frame_bytes))
+TRANSFER(direct_byte, transfer_direct(tty, data_start, size, 1))
+TRANSFER(resample, transfer_resample(tty, data_start, size))
+TRANSFER(thread, transfer_ring(tty, data_start, size))
+TRANSFER(uring, transfer_ring(tty, data_start, size))
+TRANSFER(shm, transfer_ring(tty, data_start, size))
@@ -0,0 +1,11 @@
+// Copyright (c) 2019 Daniel Abrecht
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include <libasound_module_pcm_tty.h>
+
+
+CALLBACK( playback, int, close, (snd_pcm_ioplug_t *io) ){
+  m_debug("playback_close\n");
+  pcm_tty_close(io->private_data);
+  return 0;
+}
@@ -0,0 +1,16 @@
+// Copyright (c) 2019 Daniel Abrecht
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include <libasound_module_pcm_tty.h>
+
+
+CALLBACK( playback, int, delay, (snd_pcm_ioplug_t *io, snd_pcm_sframes_t *delayp) ){
+  struct tty_snd_plug* tty = io->private_data;
+  // Updates virtual_offset, which counts the frames handed to the tty
+  io->callback->pointer(io);
+  int queued = pcm_tty_queued(tty);
+  // Frames not handed to the tty yet, plus the time the tty needs to send what it and the resampler have queued
+  *delayp = snd_pcm_ioplug_hw_avail(io, tty->virtual_offset, io->appl_ptr) + pcm_tty_line_delay(tty, queued + tty->resampler.pending);
+  pcm_tty_trace(tty, PCM_TTY_TRACE_delay, *delayp, queued);
+  return 0;
+}
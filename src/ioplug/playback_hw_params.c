@@ -0,0 +1,11 @@
+// Copyright (c) 2019 Daniel Abrecht
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include <libasound_module_pcm_tty.h>
+
+
+CALLBACK( playback, int, hw_params, (snd_pcm_ioplug_t *io, snd_pcm_hw_params_t *params) ){
+  (void)params;
+  m_debug("playback_hw_params\n");
+  return pcm_tty_hw_params(io->private_data);
+}
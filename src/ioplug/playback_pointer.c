@@ -5,7 +5,48 @@
 
 
 CALLBACK( playback, snd_pcm_sframes_t, pointer, (snd_pcm_ioplug_t *io) ){
-  m_debug("playback_pointer\n");
   struct tty_snd_plug* tty = io->private_data;
-  return tty->virtual_offset;
+  // The writer thread gave up on the tty
+  int error = pcm_tty_thread_error(tty);
+  if(error)
+    return error;
+  if(tty->uring){
+    error = pcm_tty_uring_update(tty);
+    if(error < 0)
+      return error;
+  }
+  if(tty->ring){
+    // Only count what the writer thread or io_uring has actually written
+    uint32_t position = pcm_tty_ring_read_position(tty->ring);
+    int32_t flushed = position - tty->ring_position;
+    // Only count whole frames, the rest of an incomplete one is counted once it's complete
+    if(flushed >= (int32_t)tty->frame_bytes){
+      snd_pcm_sframes_t frames = flushed / tty->frame_bytes;
+      tty->virtual_offset += frames;
+      tty->ring_position += frames * tty->frame_bytes;
+    }
+  }
+  snd_pcm_sframes_t position = tty->virtual_offset;
+  int queued = -1; // Only looked at if needed
+  if(tty->settings.hw_pointer || tty->resampler.active || tty->stats){
+    queued = pcm_tty_queued(tty);
+    if(tty->resampler.active)
+      pcm_tty_resample_update(tty, queued);
+    pcm_tty_stats_sample(tty->stats, PCM_TTY_STATS_queue_depth, queued + (tty->ring ? pcm_tty_ring_fill(tty->ring) : 0));
+  }
+  if(tty->settings.hw_pointer){
+    if(tty->resampler.active){
+      // Neither the tty queue nor what the resampler couldn't write yet has been played
+      position -= pcm_tty_resample_app_frames(tty, (queued + tty->resampler.pending) / tty->frame_bytes);
+    }else{
+      // Data still waiting in the kernel tty buffer hasn't been played yet
+      position -= queued / tty->frame_bytes;
+    }
+    // The queue may have grown since virtual_offset was updated, never go backwards
+    if(position < tty->last_pointer)
+      position = tty->last_pointer;
+  }
+  tty->last_pointer = position;
+  pcm_tty_trace(tty, PCM_TTY_TRACE_pointer, position, queued);
+  return position;
 }
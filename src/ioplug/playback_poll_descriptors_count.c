@@ -0,0 +1,10 @@
+// Copyright (c) 2019 Daniel Abrecht
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include <libasound_module_pcm_tty.h>
+
+
+CALLBACK( playback, int, poll_descriptors_count, (snd_pcm_ioplug_t *io) ){
+  struct tty_snd_plug* tty = io->private_data;
+  return pcm_tty_poll_descriptors_count(tty);
+}
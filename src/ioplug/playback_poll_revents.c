@@ -0,0 +1,37 @@
+// Copyright (c) 2019 Daniel Abrecht
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include <libasound_module_pcm_tty.h>
+
+
+CALLBACK( playback, int, poll_revents, (snd_pcm_ioplug_t *io, struct pollfd *pfd, unsigned int nfds, unsigned short *revents) ){
+  struct tty_snd_plug* tty = io->private_data;
+  if(tty->timer_fd != -1){
+    if(nfds != 2)
+      return -EINVAL;
+    *revents = pcm_tty_timer_revents(tty, pfd);
+    return 0;
+  }
+  if(nfds != 1)
+    return -EINVAL;
+  unsigned short events = pfd[0].revents;
+  if(tty->ring && (events & POLLIN)){
+    if(tty->shm){
+      // v253_splitter_daemon made room in the ring, or the modem entered or left voice mode
+      pcm_tty_shm_ack(tty);
+    }else if(tty->uring){
+      // A write completed, or failed
+      if(pcm_tty_uring_update(tty) < 0)
+        events |= POLLERR;
+    }else{
+      // The writer thread made room in the ring, or gave up
+      uint64_t count;
+      while(read(tty->thread.notify_fd, &count, sizeof(count)) == -1 && errno == EINTR);
+      if(pcm_tty_thread_error(tty))
+        events |= POLLERR;
+    }
+    events = (events & ~POLLIN) | POLLOUT;
+  }
+  *revents = events;
+  return 0;
+}
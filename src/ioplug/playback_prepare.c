@@ -0,0 +1,39 @@
+// Copyright (c) 2019 Daniel Abrecht
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include <libasound_module_pcm_tty.h>
+#include <pcm_tty_shm.h>
+
+
+CALLBACK( playback, int, prepare, (snd_pcm_ioplug_t *io) ){
+  m_debug("playback_prepare\n");
+  struct tty_snd_plug* tty = io->private_data;
+  pcm_tty_trace(tty, PCM_TTY_TRACE_prepare, 0, 0);
+  tty->virtual_offset = 0;
+  tty->last_pointer = 0;
+  tty->partial = 0;
+  if(tty->resampler.active)
+    pcm_tty_resample_reset(tty);
+  int error = pcm_tty_timer_arm(tty);
+  if(error < 0)
+    return error;
+  if(tty->ring){
+    // Anything still queued belongs to the previous run
+    tty->ring_position = pcm_tty_ring_write_position(tty->ring);
+    if(tty->shm){
+      // Only v253_splitter_daemon can drop it
+      struct pcm_tty_shm_control* control = tty->shm;
+      __atomic_store_n(&control->playback_drop, tty->ring_position, __ATOMIC_RELEASE);
+      pcm_tty_shm_kick(tty);
+      return 0;
+    }
+    pcm_tty_stats_add(tty->stats, PCM_TTY_STATS_playback_dropped, tty->ring_position - pcm_tty_ring_read_position(tty->ring));
+    __atomic_store_n(&tty->ring_drop, tty->ring_position, __ATOMIC_RELEASE);
+    if(tty->uring){
+      return pcm_tty_uring_update(tty);
+    }else{
+      pcm_tty_thread_wake(tty);
+    }
+  }
+  return 0;
+}
@@ -5,7 +5,7 @@
 
 
 CALLBACK( playback, int, start, (snd_pcm_ioplug_t *io) ){
-  (void)io;
   m_debug("playback_start\n");
+  pcm_tty_trace(io->private_data, PCM_TTY_TRACE_start, 0, 0);
   return 0;
 }
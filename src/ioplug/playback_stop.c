@@ -5,7 +5,9 @@
 
 
 CALLBACK( playback, int, stop, (snd_pcm_ioplug_t *io) ){
-  (void)io;
   m_debug("playback_stop\n");
+  struct tty_snd_plug* tty = io->private_data;
+  pcm_tty_trace(tty, PCM_TTY_TRACE_stop, 0, 0);
+  pcm_tty_timer_disarm(tty);
   return 0;
 }
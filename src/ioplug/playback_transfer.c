@@ -5,55 +5,115 @@
 
 #include <libasound_module_pcm_tty.h>
 
-CALLBACK( playback,
-  snd_pcm_sframes_t, transfer, (
-    snd_pcm_ioplug_t *io,
-    const snd_pcm_channel_area_t *areas,
-    snd_pcm_uframes_t offset,
-    snd_pcm_uframes_t size
-  )
-){
-  m_debug("playback_transfer: %ld %ld\n", offset, size);
-  struct tty_snd_plug* tty = io->private_data;
-  ssize_t s, os=size;
-  for( unsigned channel=0; channel<io->channels; channel++){
-    uint8_t* data_start = (uint8_t*)areas[channel].addr + areas[channel].first / 8;
-    if(tty->settings.mode == PCM_TTY_MODE_v253){
-      if(tty->shm[0]){
-        uint8_t convbuf[256];
-        while(os){
-          ssize_t m, i;
-          for(m=0, i=0; i<os && m<256; i++,m++){
-            uint8_t b = data_start[i];
-            if(b == C_DLE){
-              if(m >= 255)
-                break;
-              convbuf[m++] = C_DLE;
-            }
-            convbuf[m] = b;
-          }
-          os -= i;
-          data_start += i;
-          uint8_t* cb = convbuf;
-          while(m && (s=write(tty->device_fd, cb, m))>0){
-            m -= s;
-            cb += s;
-          }
-          if(m) break;
-        }
-      }else{
-        data_start += os;
-        os = 0;
-      }
-    }else{
-      while(os && (s=write(tty->device_fd, data_start, os))>0){
-        os -= s;
-        data_start += s;
-      }
-    }
-    break;
+// Writes data in the line format to the tty, returns how much of it was taken
+static size_t playback_write(struct tty_snd_plug* tty, const uint8_t* data_start, size_t size){
+  ssize_t s, os = size;
+  while(os && (s=write(tty->device_fd, data_start, os))>0){
+    os -= s;
+    data_start += s;
+  }
+  pcm_tty_stats_add(tty->stats, PCM_TTY_STATS_bytes_written, size - os);
+  if(os){
+    pcm_tty_stats_add(tty->stats, PCM_TTY_STATS_short_writes, 1);
+    pcm_tty_trace(tty, PCM_TTY_TRACE_short_io, size, size - os);
   }
-  m_debug("%zd\n", size - os);
-  tty->virtual_offset += size - os;
   return size - os;
 }
+
+// The writer thread, io_uring or v253_splitter_daemon does the rest. Only whole frames go into the ring.
+static inline snd_pcm_sframes_t transfer_ring(struct tty_snd_plug* tty, const uint8_t* data_start, snd_pcm_uframes_t size, enum pcm_tty_io io_mode){
+  size_t frame_bytes = tty->frame_bytes;
+  size_t frames = (tty->ring_size - pcm_tty_ring_fill(tty->ring)) / frame_bytes;
+  if(frames > size)
+    frames = size;
+  if(!tty->convert.active){
+    pcm_tty_ring_put(tty->ring, tty->ring_size, data_start, frames * frame_bytes);
+  }else{
+    // Line format samples are single bytes, so it doesn't matter where the ring wraps around
+    size_t samples = frames * tty->ioplug.channels;
+    for(int i=0; i<2 && samples; i++){
+      uint8_t* dst;
+      size_t n = pcm_tty_ring_reserve(tty->ring, tty->ring_size, &dst);
+      if(n > samples)
+        n = samples;
+      pcm_tty_encode(&tty->convert, dst, data_start, n);
+      pcm_tty_ring_commit(tty->ring, n);
+      data_start += n * tty->convert.app_bytes;
+      samples -= n;
+    }
+  }
+  switch(io_mode){
+    case PCM_TTY_IO_shm: pcm_tty_shm_kick(tty); break;
+    case PCM_TTY_IO_uring: pcm_tty_uring_update(tty); break;
+    default: pcm_tty_thread_wake(tty); break;
+  }
+  pcm_tty_trace(tty, PCM_TTY_TRACE_transfer_done, frames, 0);
+  return frames;
+}
+
+// With single byte frames, there is never an incomplete frame left over
+static inline snd_pcm_sframes_t transfer_direct(struct tty_snd_plug* tty, const uint8_t* data_start, snd_pcm_uframes_t size, size_t frame_bytes){
+  size_t partial = frame_bytes > 1 ? tty->partial : 0;
+  // The start of the first frame may already have been written last time
+  size_t done;
+  if(!tty->convert.active){
+    done = partial + playback_write(tty, data_start + partial, size * frame_bytes - partial);
+  }else{
+    // The application buffer mustn't be modified, so convert it a chunk at a time
+    uint8_t convbuf[1024];
+    size_t chunk = sizeof(convbuf) / frame_bytes;
+    size_t skip = partial;
+    done = 0;
+    for(size_t frame=0; frame<size; frame+=chunk){
+      size_t n = size - frame < chunk ? size - frame : chunk;
+      pcm_tty_encode(&tty->convert, convbuf, data_start + frame * tty->app_frame_bytes, n * tty->ioplug.channels);
+      size_t m = n * frame_bytes - skip;
+      size_t w = playback_write(tty, convbuf + skip, m);
+      done += skip + w;
+      skip = 0;
+      if(w < m)
+        break;
+    }
+  }
+  if(frame_bytes > 1)
+    tty->partial = done % frame_bytes;
+  pcm_tty_trace(tty, PCM_TTY_TRACE_transfer_done, done / frame_bytes, frame_bytes > 1 ? tty->partial : 0);
+  tty->virtual_offset += done / frame_bytes;
+  return done / frame_bytes;
+}
+
+static inline snd_pcm_sframes_t transfer_resample(struct tty_snd_plug* tty, const uint8_t* data_start, snd_pcm_uframes_t size){
+  snd_pcm_sframes_t frames = pcm_tty_resample_write(tty, data_start, size);
+  tty->virtual_offset += frames;
+  pcm_tty_trace(tty, PCM_TTY_TRACE_transfer_done, frames, tty->resampler.pending);
+  return frames;
+}
+
+// Defines the transfer callback of a variant, see PCM_TTY_TRANSFER_VARIANTS. It's timed if there are stats.
+#define TRANSFER(VARIANT, CALL) \
+  CALLBACK( playback_ ## VARIANT, \
+    snd_pcm_sframes_t, transfer, ( \
+      snd_pcm_ioplug_t *io, \
+      const snd_pcm_channel_area_t *areas, \
+      snd_pcm_uframes_t offset, \
+      snd_pcm_uframes_t size \
+    ) \
+  ){ \
+    struct tty_snd_plug* tty = io->private_data; \
+    pcm_tty_trace(tty, PCM_TTY_TRACE_transfer, offset, size); \
+    /* The channels are interleaved, so all the data is in one block starting at the first channel */ \
+    const uint8_t* data_start = (const uint8_t*)areas[0].addr + (areas[0].first + offset * areas[0].step) / 8; \
+    if(!tty->stats) \
+      return CALL; \
+    uint64_t start = pcm_tty_now(); \
+    snd_pcm_sframes_t ret = CALL; \
+    pcm_tty_stats_sample(tty->stats, PCM_TTY_STATS_transfer_latency, (pcm_tty_now() - start) / 1000); \
+    return ret; \
+  }
+
+TRANSFER(direct, transfer_direct(tty, data_start, size, tty->frame_bytes))
+TRANSFER(direct_byte, transfer_direct(tty, data_start, size, 1))
+TRANSFER(resample, transfer_resample(tty, data_start, size))
+TRANSFER(thread, transfer_ring(tty, data_start, size, PCM_TTY_IO_thread))
+TRANSFER(uring, transfer_ring(tty, data_start, size, PCM_TTY_IO_uring))
+TRANSFER(shm, transfer_ring(tty, data_start, size, PCM_TTY_IO_shm))
@@ -11,16 +11,84 @@
 #include <stdbool.h>
 #include <stdint.h>
 #include <string.h>
+#include <unistd.h>
 
 DEFINE_IOPLUG_CALLBACKS(playback)
 DEFINE_IOPLUG_CALLBACKS(capture)
 
+#define X(Y) \
+  DEFINE_IOPLUG_CALLBACKS(playback_ ## Y) \
+  DEFINE_IOPLUG_CALLBACKS(capture_ ## Y)
+PCM_TTY_TRANSFER_VARIANTS
+#undef X
+
+enum pcm_tty_transfer {
+#define X(Y) PCM_TTY_TRANSFER_ ## Y,
+  PCM_TTY_TRANSFER_VARIANTS
+#undef X
+  PCM_TTY_TRANSFER_COUNT
+};
+
+static snd_pcm_ioplug_callback_t*const transfer_callbacks[][PCM_TTY_TRANSFER_COUNT] = {
+  [SND_PCM_STREAM_PLAYBACK] = {
+#define X(Y) &IOPLUG_CALLBACKS_REF(playback_ ## Y),
+    PCM_TTY_TRANSFER_VARIANTS
+#undef X
+  },
+  [SND_PCM_STREAM_CAPTURE] = {
+#define X(Y) &IOPLUG_CALLBACKS_REF(capture_ ## Y),
+    PCM_TTY_TRANSFER_VARIANTS
+#undef X
+  },
+};
+
+static pthread_once_t transfer_callbacks_once = PTHREAD_ONCE_INIT;
+
+// The variants only have their transfer callback set so far, the rest is the same for all of them
+static void transfer_callbacks_init(void){
+  const snd_pcm_ioplug_callback_t* base[] = {
+    [SND_PCM_STREAM_PLAYBACK] = &IOPLUG_CALLBACKS_REF(playback),
+    [SND_PCM_STREAM_CAPTURE] = &IOPLUG_CALLBACKS_REF(capture),
+  };
+  for(int stream=0; stream<2; stream++){
+    for(int i=0; i<PCM_TTY_TRANSFER_COUNT; i++){
+      snd_pcm_ioplug_callback_t callbacks = *base[stream];
+      callbacks.transfer = transfer_callbacks[stream][i]->transfer;
+      *transfer_callbacks[stream][i] = callbacks;
+    }
+  }
+}
+
+// Picks the callback table of the stream, once the io mode is settled
+static const snd_pcm_ioplug_callback_t* transfer_callbacks_get(const struct tty_snd_plug* tty){
+  pthread_once(&transfer_callbacks_once, transfer_callbacks_init);
+  enum pcm_tty_transfer variant;
+  switch(tty->settings.io){
+    case PCM_TTY_IO_thread: variant = PCM_TTY_TRANSFER_thread; break;
+    case PCM_TTY_IO_uring: variant = PCM_TTY_TRANSFER_uring; break;
+    case PCM_TTY_IO_shm: variant = PCM_TTY_TRANSFER_shm; break;
+    default: {
+      if(tty->settings.resample){
+        variant = PCM_TTY_TRANSFER_resample;
+      }else if(tty->frame_bytes == 1){
+        variant = PCM_TTY_TRANSFER_direct_byte;
+      }else{
+        variant = PCM_TTY_TRANSFER_direct;
+      }
+    } break;
+  }
+  return transfer_callbacks[tty->stream][variant];
+}
+
 #define SPEEDS \
   X(    50) X(    75) X(   110) X(   134) \
   X(   150) X(   200) X(   300) X(   600) \
   X(  1200) X(  1800) X(  2400) X(  4800) \
   X(  9600) X( 19200) X( 38400) X( 57600) \
-  X(115200) X(230400)
+  X(115200) X(230400) X(460800) X(500000) \
+  X(576000) X(921600) X(1000000) X(1152000) \
+  X(1500000) X(2000000) X(2500000) X(3000000) \
+  X(3500000) X(4000000)
 
 #define X(Y) B ## Y,
 static const speed_t baudconst_list[] = { SPEEDS };
@@ -38,6 +106,13 @@ const char* pcm_tty_mode_list[] = {
   0
 };
 
+const char* pcm_tty_io_list[] = {
+#define X(Y) #Y,
+  PCM_TTY_IO_MODES
+#undef X
+  0
+};
+
 unsigned long const2baud(speed_t b){
   for(size_t i=0; i<baudrate_count; i++)
     if(baudconst_list[i] == b)
@@ -52,6 +127,11 @@ speed_t baud2const(unsigned long s){
   return 0;
 }
 
+// The driver may only be able to approximate a rate, allow the usual UART tolerance
+static bool baudrate_matches(unsigned long requested, unsigned long actual){
+  return actual * 100 >= requested * 98 && actual * 100 <= requested * 102;
+}
+
 void free_settings(struct pcm_tty_settings* settings){
   if(settings->device)
     free(settings->device);
@@ -61,6 +141,11 @@ void free_settings(struct pcm_tty_settings* settings){
 int parse_settings(snd_config_t* conf, const char*const ignore[], struct pcm_tty_settings* ret){
   int error;
   struct pcm_tty_settings settings = {0};
+  settings.format = SND_PCM_FORMAT_UNKNOWN;
+  settings.mode = PCM_TTY_MODE_INVALID;
+  settings.io = PCM_TTY_IO_INVALID;
+  settings.vmin = -1;
+  settings.vtime = -1;
   snd_config_iterator_t i, next;
   snd_config_for_each(i, next, conf){
     snd_config_t* entry = snd_config_iterator_entry(i);
@@ -82,14 +167,8 @@ int parse_settings(snd_config_t* conf, const char*const ignore[], struct pcm_tty
       error = snd_config_get_integer(entry, &baudrate);
       if(error < 0)
         goto backout;
-      bool found = false;
-      for(size_t i=0; i<baudrate_count; i++){
-        if(baudrate_list[i] == (unsigned long)baudrate){
-          found = true;
-          break;
-        }
-      }
-      if(!found){
+      // Rates without a Bxxx constant are set using termios2 & BOTHER
+      if(baudrate <= 0){
         SNDERR("Invalid baud rate");
         error = -EINVAL;
         goto backout;
@@ -110,6 +189,36 @@ int parse_settings(snd_config_t* conf, const char*const ignore[], struct pcm_tty
       settings.samplerate = samplerate;
       continue;
     }
+    if( !strcmp(property, "channels") ){
+      long channels = 0;
+      error = snd_config_get_integer(entry, &channels);
+      if(error < 0)
+        goto backout;
+      if(channels <= 0 || channels > PCM_TTY_CHANNELS_MAX){
+        SNDERR("Channels must be between 1 and %d", PCM_TTY_CHANNELS_MAX);
+        error = -EINVAL;
+        goto backout;
+      }
+      settings.channels = channels;
+      continue;
+    }
+    if( !strcmp(property, "latency") || !strcmp(property, "period_time") ){
+      long ms = 0;
+      error = snd_config_get_integer(entry, &ms);
+      if(error < 0)
+        goto backout;
+      if(ms <= 0 || ms > 60000){
+        SNDERR("%s must be between 1 and 60000 ms", property);
+        error = -EINVAL;
+        goto backout;
+      }
+      if(property[0] == 'l'){
+        settings.latency = ms;
+      }else{
+        settings.period_time = ms;
+      }
+      continue;
+    }
     if( !strcmp(property, "format") ){
       char* tmp = 0;
       error = snd_config_get_ascii(entry, &tmp);
@@ -136,6 +245,107 @@ int parse_settings(snd_config_t* conf, const char*const ignore[], struct pcm_tty
       }
       continue;
     }
+    if( !strcmp(property, "hw_pointer") ){
+      error = snd_config_get_bool(entry);
+      if(error < 0)
+        goto backout;
+      settings.hw_pointer = error;
+      continue;
+    }
+    if( !strcmp(property, "resample") ){
+      error = snd_config_get_bool(entry);
+      if(error < 0)
+        goto backout;
+      settings.resample = error;
+      continue;
+    }
+    if( !strcmp(property, "trace") ){
+      error = snd_config_get_bool(entry);
+      if(error < 0)
+        goto backout;
+      settings.trace = error;
+      continue;
+    }
+    if( !strcmp(property, "stats") ){
+      error = snd_config_get_bool(entry);
+      if(error < 0)
+        goto backout;
+      settings.stats = error;
+      continue;
+    }
+    if( !strcmp(property, "low_latency") ){
+      error = snd_config_get_bool(entry);
+      if(error < 0)
+        goto backout;
+      settings.low_latency = error;
+      continue;
+    }
+    if( !strcmp(property, "iflag") || !strcmp(property, "oflag") || !strcmp(property, "cflag") || !strcmp(property, "lflag") ){
+      long flags = 0;
+      error = snd_config_get_integer(entry, &flags);
+      if(error < 0)
+        goto backout;
+      if(flags < 0 || (unsigned long)flags > (tcflag_t)-1){
+        SNDERR("Invalid %s", property);
+        error = -EINVAL;
+        goto backout;
+      }
+      switch(property[0]){
+        case 'i': settings.iflag = flags; break;
+        case 'o': settings.oflag = flags; break;
+        case 'c': settings.cflag = flags; break;
+        case 'l': settings.lflag = flags; break;
+      }
+      continue;
+    }
+    if( !strcmp(property, "vmin") || !strcmp(property, "vtime") ){
+      long value = 0;
+      error = snd_config_get_integer(entry, &value);
+      if(error < 0)
+        goto backout;
+      if(value < 0 || value > 255){
+        SNDERR("%s must be between 0 and 255", property);
+        error = -EINVAL;
+        goto backout;
+      }
+      if(property[1] == 'm'){
+        settings.vmin = value;
+      }else{
+        settings.vtime = value;
+      }
+      continue;
+    }
+    if( !strcmp(property, "latency_timer") || !strcmp(property, "rx_trigger") ){
+      long value = 0;
+      error = snd_config_get_integer(entry, &value);
+      if(error < 0)
+        goto backout;
+      if(value <= 0 || value > 255){
+        SNDERR("%s must be between 1 and 255", property);
+        error = -EINVAL;
+        goto backout;
+      }
+      if(property[0] == 'l'){
+        settings.latency_timer = value;
+      }else{
+        settings.rx_trigger = value;
+      }
+      continue;
+    }
+    if( !strcmp(property, "io") ){
+      char* tmp = 0;
+      error = snd_config_get_ascii(entry, &tmp);
+      if(error < 0)
+        goto backout;
+      settings.io = pcm_tty_indexof(tmp, pcm_tty_io_list);
+      free(tmp);
+      if(settings.io == -1){
+        SNDERR("Invalid io mode");
+        error = -EINVAL;
+        goto backout;
+      }
+      continue;
+    }
     SNDERR("Unknown field %s", property);
     error = -EINVAL;
     goto backout;
@@ -152,7 +362,10 @@ int pcm_tty_configure(snd_pcm_ioplug_t* io){
   struct tty_snd_plug* tty = io->private_data;
   int error;
 
-  error = snd_pcm_ioplug_set_param_list(io, SND_PCM_IOPLUG_HW_FORMAT, 1, (unsigned int[]){tty->settings.format});
+  // The line format itself, and, if it's one we can convert to, the formats applications commonly use
+  unsigned formats[8];
+  size_t format_count = pcm_tty_convert_formats(tty->settings.format, formats, sizeof(formats) / sizeof(*formats));
+  error = snd_pcm_ioplug_set_param_list(io, SND_PCM_IOPLUG_HW_FORMAT, format_count, formats);
   if(error < 0)
     return error;
 
@@ -160,11 +373,46 @@ int pcm_tty_configure(snd_pcm_ioplug_t* io){
   if(error < 0)
     return error;
 
-  error = snd_pcm_ioplug_set_param_minmax(io, SND_PCM_IOPLUG_HW_BUFFER_BYTES, 1, 1<<14);
+  // The limits are in frames, but ioplug only takes them in bytes, which depend on the format the application picks.
+  // So the maximums are for the narrowest format and the minimums for the widest one, then they hold whichever it picks.
+  unsigned sample_bytes_min = ~0u, sample_bytes_max = 0;
+  for(size_t i=0; i<format_count; i++){
+    unsigned bytes = snd_pcm_format_physical_width(formats[i]) / 8;
+    if(bytes < sample_bytes_min)
+      sample_bytes_min = bytes;
+    if(bytes > sample_bytes_max)
+      sample_bytes_max = bytes;
+  }
+  unsigned frame_bytes_min = sample_bytes_min * tty->settings.channels;
+  unsigned frame_bytes_max = sample_bytes_max * tty->settings.channels;
+
+  unsigned period_bytes_min = tty->period_frames_min * frame_bytes_max;
+  unsigned period_bytes_max = tty->period_frames_max * frame_bytes_min;
+  unsigned buffer_bytes_min = tty->period_frames_min * 2 * frame_bytes_max;
+  unsigned buffer_bytes_max = tty->buffer_frames_max * frame_bytes_min;
+  // That's impossible for a fixed period_time, pcm_tty_hw_params rejects what doesn't fit then
+  if(period_bytes_min > period_bytes_max){
+    period_bytes_min = tty->period_frames_min * frame_bytes_min;
+    period_bytes_max = tty->period_frames_max * frame_bytes_max;
+  }
+  if(buffer_bytes_min > buffer_bytes_max){
+    buffer_bytes_min = tty->period_frames_min * 2 * frame_bytes_min;
+    buffer_bytes_max = tty->buffer_frames_max * frame_bytes_max;
+  }
+
+  error = snd_pcm_ioplug_set_param_minmax(io, SND_PCM_IOPLUG_HW_PERIOD_BYTES, period_bytes_min, period_bytes_max);
+  if(error < 0)
+    return error;
+
+  error = snd_pcm_ioplug_set_param_minmax(io, SND_PCM_IOPLUG_HW_BUFFER_BYTES, buffer_bytes_min, buffer_bytes_max);
+  if(error < 0)
+    return error;
+
+  error = snd_pcm_ioplug_set_param_minmax(io, SND_PCM_IOPLUG_HW_PERIODS, 2, PCM_TTY_PERIODS_MAX);
   if(error < 0)
     return error;
 
-  error = snd_pcm_ioplug_set_param_minmax(io, SND_PCM_IOPLUG_HW_CHANNELS, 1, 1);
+  error = snd_pcm_ioplug_set_param_minmax(io, SND_PCM_IOPLUG_HW_CHANNELS, tty->settings.channels, tty->settings.channels);
   if(error < 0)
     return error;
 
@@ -175,20 +423,293 @@ int pcm_tty_configure(snd_pcm_ioplug_t* io){
   return 0;
 }
 
+// Derives the buffer and period limits from the line speed, so the buffer holds the same time at any baud rate
+static int buffer_limits(struct tty_snd_plug* tty){
+  unsigned latency = tty->settings.latency ? tty->settings.latency : PCM_TTY_LATENCY_DEFAULT;
+  if(tty->settings.period_time && tty->settings.period_time * 2 > latency){
+    if(tty->settings.latency){
+      SNDERR("The latency must be at least two periods");
+      return -EINVAL;
+    }
+    latency = tty->settings.period_time * 2;
+  }
+  snd_pcm_uframes_t buffer_max = pcm_tty_line_frames(tty, latency);
+  snd_pcm_uframes_t period_min, period_max;
+  if(tty->settings.period_time){
+    period_min = period_max = pcm_tty_line_frames(tty, tty->settings.period_time);
+  }else{
+    period_min = pcm_tty_line_frames(tty, PCM_TTY_PERIOD_TIME_MIN);
+    period_max = buffer_max / 2;
+  }
+  // The shared memory rings of v253_splitter_daemon have a fixed size
+  snd_pcm_uframes_t frames_max = (tty->shm ? tty->ring_size : PCM_TTY_BUFFER_BYTES_MAX) / tty->frame_bytes;
+  if(buffer_max > frames_max)
+    buffer_max = frames_max;
+  if(period_max > buffer_max / 2)
+    period_max = buffer_max / 2;
+  if(!period_min)
+    period_min = 1;
+  if(period_max < period_min)
+    period_max = period_min;
+  if(buffer_max < period_min * 2)
+    buffer_max = period_min * 2;
+  tty->buffer_frames_max = buffer_max;
+  tty->period_frames_min = period_min;
+  tty->period_frames_max = period_max;
+  m_debug("buffer: up to %lu frames, period: %lu to %lu frames\n", buffer_max, period_min, period_max);
+  return 0;
+}
+
+int pcm_tty_hw_params(struct tty_snd_plug* tty){
+  int width = snd_pcm_format_physical_width(tty->ioplug.format);
+  if(width <= 0 || width % 8)
+    return -EINVAL;
+  int error = pcm_tty_convert_init(&tty->convert, tty->ioplug.format, tty->settings.format, tty->settings.resample);
+  if(error < 0)
+    return error;
+  tty->resampler.active = tty->settings.resample;
+  if(tty->trace)
+    tty->trace->rate = tty->ioplug.rate;
+  // The rings only hold buffer_frames_max frames, and shorter periods than period_frames_min wake us up too often
+  if(tty->ioplug.buffer_size > tty->buffer_frames_max || tty->ioplug.period_size < tty->period_frames_min){
+    SNDERR("A buffer of %lu frames with periods of %lu frames is out of range, the buffer can hold up to %lu frames, a period needs at least %lu",
+      tty->ioplug.buffer_size, tty->ioplug.period_size, tty->buffer_frames_max, tty->period_frames_min);
+    return -EINVAL;
+  }
+  tty->app_frame_bytes = width / 8 * tty->ioplug.channels;
+  tty->frame_bytes = snd_pcm_format_physical_width(tty->settings.format) / 8 * tty->ioplug.channels;
+  tty->partial = 0;
+  return 0;
+}
+
+void pcm_tty_close(struct tty_snd_plug* tty){
+  pcm_tty_thread_stop(tty);
+  pcm_tty_uring_stop(tty);
+  pcm_tty_shm_detach(tty);
+  pcm_tty_timer_close(tty);
+  pcm_tty_trace_close(tty);
+  pcm_tty_stats_close(tty);
+  free(tty->ring);
+  if(tty->device_fd != -1){
+    pcm_tty_serial_restore(tty->device_fd, &tty->serial_saved);
+    close(tty->device_fd);
+  }
+  free_settings(&tty->settings);
+  free(tty);
+}
+
+// Changes a sysfs attribute, previous is what it was before anything was changed, 0 if unknown
+static void serial_attribute(int device_fd, const char* attribute, unsigned value, unsigned previous, unsigned* saved){
+  int error = pcm_tty_serial_attribute(device_fd, attribute, value);
+  if(error < 0){
+    m_debug("%s not set: %s\n", attribute, strerror(-error));
+    return;
+  }
+  if(previous != value)
+    *saved = previous;
+}
+
+// Not every driver has these, the tty works without them, just with more latency
+static void serial_low_latency(int device_fd, const struct pcm_tty_settings* settings, struct pcm_tty_serial_saved* saved){
+  unsigned latency_timer = settings->latency_timer;
+  unsigned rx_trigger = settings->rx_trigger;
+  // ASYNC_LOW_LATENCY can change the latency timer too, so get them before anything changes
+  unsigned previous_latency_timer = 0, previous_rx_trigger = 0;
+  pcm_tty_serial_attribute_get(device_fd, "device/latency_timer", &previous_latency_timer);
+  pcm_tty_serial_attribute_get(device_fd, "rx_trig_bytes", &previous_rx_trigger);
+  if(settings->low_latency){
+    int error = pcm_tty_serial_low_latency(device_fd, true);
+    if(error < 0)
+      m_debug("ASYNC_LOW_LATENCY not set: %s\n", strerror(-error));
+    saved->low_latency = error > 0;
+    if(!latency_timer)
+      latency_timer = 1;
+    if(!rx_trigger)
+      rx_trigger = 1;
+  }
+  if(latency_timer)
+    serial_attribute(device_fd, "device/latency_timer", latency_timer, previous_latency_timer, &saved->latency_timer);
+  if(rx_trigger)
+    serial_attribute(device_fd, "rx_trig_bytes", rx_trigger, previous_rx_trigger, &saved->rx_trigger);
+}
+
+// Opens the tty and sets it up, returns the file descriptor
+static int open_tty(
+  struct pcm_tty_settings* settings,
+  struct pcm_tty_settings* s_playback,
+  struct pcm_tty_settings* s_capture,
+  snd_pcm_stream_t stream,
+  struct termios* ret_termios,
+  struct pcm_tty_serial_saved* ret_serial
+){
+  int error = 0;
+  struct stat ttystat;
+  struct termios termios;
+  memset(&termios, 0, sizeof(termios));
+
+  bool in_out_same_tty = s_playback->device && s_capture->device && !strcmp(s_playback->device, s_capture->device);
+
+  int device_fd = open(settings->device, (stream == SND_PCM_STREAM_PLAYBACK ? O_WRONLY : (O_RDONLY | O_NDELAY | O_NONBLOCK)) | O_NOCTTY);
+  if(device_fd == -1){
+    SNDERR("Failed to open tty device (%s)", settings->device);
+    return -errno;
+  }
+
+  if(fstat(device_fd, &ttystat) == -1){
+    SNDERR("Failed to stat tty device (%s)", settings->device);
+    error = -errno;
+    goto backout;
+  }
+
+  if(!S_ISCHR(ttystat.st_mode)){
+    SNDERR("specified tty device file (%s) is not a character device file", settings->device);
+    error = -EINVAL;
+    goto backout;
+  }
+
+  if(tcgetattr(device_fd, &termios) != 0){
+    error = -errno;
+    SNDERR("tcgetattr failed");
+    goto backout;
+  }
+
+  unsigned long cur_baudrate_in, cur_baudrate_out;
+  if(pcm_tty_get_baudrate(device_fd, &cur_baudrate_in, &cur_baudrate_out) < 0){
+    cur_baudrate_in = const2baud(cfgetispeed(&termios));
+    cur_baudrate_out = const2baud(cfgetospeed(&termios));
+  }
+
+  if(s_playback->baudrate){
+    cur_baudrate_out = s_playback->baudrate;
+  }else{
+    if(!cur_baudrate_out){
+      SNDERR("Please set a baud rate");
+      error = -EINVAL;
+      goto backout;
+    }
+    s_playback->baudrate = cur_baudrate_out;
+  }
+
+  if(s_capture->baudrate){
+    cur_baudrate_in = s_capture->baudrate;
+  }else{
+    if(!cur_baudrate_in){
+      SNDERR("Please set a baud rate");
+      error = -EINVAL;
+      goto backout;
+    }
+    s_capture->baudrate = cur_baudrate_in;
+  }
+
+  if( s_capture->samplerate  > s_capture->baudrate
+   || s_playback->samplerate > s_playback->baudrate
+  ){
+    SNDERR("A sample rate higher than the baud rate is impossible");
+    error = -EINVAL;
+    goto backout;
+  }
+
+  if(!s_capture->samplerate)
+    s_capture->samplerate = s_capture->baudrate;
+  if(!s_playback->samplerate)
+    s_playback->samplerate = s_playback->baudrate;
+
+  unsigned long baudin, baudout;
+  if(in_out_same_tty){
+    baudin  = s_capture->baudrate;
+    baudout = s_playback->baudrate;
+  }else if(stream == SND_PCM_STREAM_CAPTURE){
+    baudin  = s_capture->baudrate;
+    baudout = s_capture->baudrate;
+  }else{
+    baudin  = s_playback->baudrate;
+    baudout = s_playback->baudrate;
+  }
+
+  // If there is no Bxxx constant for a rate, it's set using termios2 after tcsetattr
+  speed_t baudin_const  = baud2const(baudin);
+  speed_t baudout_const = baud2const(baudout);
+  if(baudin_const)
+    cfsetispeed(&termios, baudin_const);
+  if(baudout_const)
+    cfsetospeed(&termios, baudout_const);
+
+  cfmakeraw(&termios);
+
+  // Flags from the configuration replace what cfmakeraw chose, except for the baud rate
+  if(settings->iflag)
+    termios.c_iflag = settings->iflag;
+  if(settings->oflag)
+    termios.c_oflag = settings->oflag;
+  if(settings->lflag)
+    termios.c_lflag = settings->lflag;
+  if(settings->cflag)
+    termios.c_cflag = (settings->cflag & ~(CBAUD | CIBAUD)) | (termios.c_cflag & (CBAUD | CIBAUD));
+
+  // Only blocking reads, like the ones of io_uring, use these. After cfmakeraw, a read returns as soon as there is a byte.
+  if(settings->vmin >= 0)
+    termios.c_cc[VMIN] = settings->vmin;
+  if(settings->vtime >= 0)
+    termios.c_cc[VTIME] = settings->vtime;
+
+  if(tcsetattr(device_fd, TCSANOW, &termios) != 0){
+    error = -errno;
+    SNDERR("tcsetattr failed");
+    goto backout;
+  }
+  if(!baudin_const || !baudout_const){
+    error = pcm_tty_set_baudrate(device_fd, baudin, baudout);
+    if(error < 0){
+      SNDERR("Failed to set baud rate %lu/%lu: %s", baudin, baudout, strerror(-error));
+      goto backout;
+    }
+  }
+  {
+    unsigned long actual_in, actual_out;
+    if(pcm_tty_get_baudrate(device_fd, &actual_in, &actual_out) == 0){
+      if(!baudrate_matches(baudin, actual_in) || !baudrate_matches(baudout, actual_out)){
+        SNDERR("Failed to set baud rate: requested %lu/%lu, got %lu/%lu", baudin, baudout, actual_in, actual_out);
+        error = -EINVAL;
+        goto backout;
+      }
+      settings->baudrate = stream == SND_PCM_STREAM_PLAYBACK ? actual_out : actual_in;
+    }else{
+      struct termios check;
+      if(tcgetattr(device_fd, &check) != 0){
+        error = -errno;
+        SNDERR("tcgetattr failed");
+        goto backout;
+      }
+      if( cfgetispeed(&termios) != cfgetispeed(&check)
+       || cfgetospeed(&termios) != cfgetospeed(&check)
+      ){
+        SNDERR("Failed to set baud rate");
+        error = -EINVAL;
+        goto backout;
+      }
+    }
+  }
+
+  serial_low_latency(device_fd, settings, ret_serial);
+
+  *ret_termios = termios;
+  return device_fd;
+
+backout:
+  close(device_fd);
+  return error;
+}
+
 SND_PCM_PLUGIN_DEFINE_FUNC(tty){
   (void)root;
 
   int error = 0;
-  int shm_fd = -1;
   int device_fd = -1;
-  void* shm = 0;
-  bool in_out_same_tty = false;
-  struct stat ttystat;
   struct termios termios;
+  struct pcm_tty_serial_saved serial = {0};
   struct tty_snd_plug* tty = 0;
   struct pcm_tty_settings s_both={0}, s_capture={0}, s_playback={0};
   memset(&termios, 0, sizeof(termios));
-  memset(&ttystat, 0, sizeof(ttystat));
 
   s_capture.format = SND_PCM_FORMAT_UNKNOWN;
   s_playback.format = SND_PCM_FORMAT_UNKNOWN;
@@ -198,6 +719,14 @@ SND_PCM_PLUGIN_DEFINE_FUNC(tty){
   s_playback.mode = PCM_TTY_MODE_INVALID;
   s_both.mode = PCM_TTY_MODE_INVALID;
 
+  s_capture.io = PCM_TTY_IO_INVALID;
+  s_playback.io = PCM_TTY_IO_INVALID;
+  s_both.io = PCM_TTY_IO_INVALID;
+
+  s_capture.vmin = s_capture.vtime = -1;
+  s_playback.vmin = s_playback.vtime = -1;
+  s_both.vmin = s_both.vtime = -1;
+
   error = parse_settings(conf, (const char*[]){"comment","type","playback","capture","hint","debug",0}, &s_both);
   if(error)
     goto backout;
@@ -237,12 +766,30 @@ SND_PCM_PLUGIN_DEFINE_FUNC(tty){
       }
     if(s->mode == PCM_TTY_MODE_INVALID)
       s->mode = s_both.mode;
+    if(s->io == PCM_TTY_IO_INVALID)
+      s->io = s_both.io;
+    if(!s->hw_pointer)
+      s->hw_pointer = s_both.hw_pointer;
+    if(!s->resample)
+      s->resample = s_both.resample;
+    if(!s->trace)
+      s->trace = s_both.trace;
+    if(!s->stats)
+      s->stats = s_both.stats;
+    if(!s->low_latency)
+      s->low_latency = s_both.low_latency;
     if(s->format == SND_PCM_FORMAT_UNKNOWN)
       s->format = s_both.format;
     if(!s->baudrate)
       s->baudrate = s_both.baudrate;
     if(!s->samplerate)
       s->samplerate = s_both.samplerate;
+    if(!s->channels)
+      s->channels = s_both.channels;
+    if(!s->latency)
+      s->latency = s_both.latency;
+    if(!s->period_time)
+      s->period_time = s_both.period_time;
     if(!s->iflag)
       s->iflag = s_both.iflag;
     if(!s->oflag)
@@ -251,6 +798,14 @@ SND_PCM_PLUGIN_DEFINE_FUNC(tty){
       s->lflag = s_both.lflag;
     if(!s->cflag)
       s->cflag = s_both.cflag;
+    if(s->vmin < 0)
+      s->vmin = s_both.vmin;
+    if(s->vtime < 0)
+      s->vtime = s_both.vtime;
+    if(!s->latency_timer)
+      s->latency_timer = s_both.latency_timer;
+    if(!s->rx_trigger)
+      s->rx_trigger = s_both.rx_trigger;
   }
 
   free_settings(&s_both);
@@ -271,201 +826,197 @@ SND_PCM_PLUGIN_DEFINE_FUNC(tty){
   if(settings->mode == PCM_TTY_MODE_INVALID)
     settings->mode = PCM_TTY_MODE_raw;
 
+  if(settings->io == PCM_TTY_IO_INVALID)
+    settings->io = PCM_TTY_IO_direct;
+
   if(settings->format == SND_PCM_FORMAT_UNKNOWN){
     if(settings->mode != PCM_TTY_MODE_v253){
       SNDERR("Format must be specified");
       error = -EINVAL;
       goto backout;
     }else{
-      s_both.format = SND_PCM_FORMAT_U8; // If no format is specified, default to U8
+      settings->format = SND_PCM_FORMAT_U8; // If no format is specified, default to U8
     }
   }
 
-  in_out_same_tty = s_playback.device && s_capture.device && !strcmp(s_playback.device, s_capture.device);
+  if(!settings->channels)
+    settings->channels = 1;
 
-  device_fd = open(settings->device, (stream == SND_PCM_STREAM_PLAYBACK ? O_WRONLY : (O_RDONLY | O_NDELAY | O_NONBLOCK)) | O_NOCTTY);
-  if(device_fd == -1){
-    SNDERR("Failed to open tty device (%s)", settings->device);
-    error = -errno;
+  if(snd_pcm_format_physical_width(settings->format) <= 0 || snd_pcm_format_physical_width(settings->format) % 8){
+    SNDERR("Unsupported format, samples must be whole bytes");
+    error = -EINVAL;
     goto backout;
   }
 
-  if(fstat(device_fd, &ttystat) == -1){
-    SNDERR("Failed to stat tty device (%s)", settings->device);
-    error = -errno;
-    goto backout_dev_open;
-  }
-
-  if(!S_ISCHR(ttystat.st_mode)){
-    SNDERR("specified tty device file (%s) is not a character device file", settings->device);
-    error = EINVAL;
-    goto backout_dev_open;
-  }
-
-  if(tcgetattr(device_fd, &termios) != 0){
-    error = -errno;
-    SNDERR("tcgetattr failed");
-    goto backout_dev_open;
-  }
-
-  unsigned long cur_baudrate_in = const2baud(cfgetispeed(&termios));
-  unsigned long cur_baudrate_out = const2baud(cfgetospeed(&termios));
-
-  if(s_playback.baudrate){
-    cur_baudrate_out = s_playback.baudrate;
-  }else{
-    if(!cur_baudrate_out){
-      SNDERR("Please set a baud rate");
-      goto backout_dev_open;
-    }
-    s_playback.baudrate = cur_baudrate_out;
-  }
-
-  if(s_capture.baudrate){
-    cur_baudrate_in = s_capture.baudrate;
-  }else{
-    if(!cur_baudrate_in){
-      SNDERR("Please set a baud rate");
-      error = -EINVAL;
-      goto backout_dev_open;
-    }
-    s_capture.baudrate = cur_baudrate_in;
-  }
-
-  if( s_capture.samplerate  > s_capture.baudrate
-   || s_playback.samplerate > s_playback.baudrate
-  ){
-    SNDERR("A sample rate higher than the baud rate is impossible");
+  // The resampler works on s16, so the line format must be one that can be converted
+  if(settings->resample && pcm_tty_convert_formats(settings->format, (unsigned[2]){0}, 2) < 2){
+    SNDERR("resample isn't available for this format");
     error = -EINVAL;
-    goto backout_dev_open;
+    goto backout;
   }
 
-  if(!s_capture.samplerate)
-    s_capture.samplerate = s_capture.baudrate;
-  if(!s_playback.samplerate)
-    s_playback.samplerate = s_playback.baudrate;
-
-  speed_t baudin  = baud2const(s_capture.baudrate);
-  speed_t baudout = baud2const(s_playback.baudrate);
-
-  if(in_out_same_tty){
-    cfsetispeed(&termios, baudin);
-    cfsetospeed(&termios, baudout);
+  if(settings->mode == PCM_TTY_MODE_v253){
+    // v253_splitter_daemon owns the modem, the audio goes through its shared memory
+    if(settings->io != PCM_TTY_IO_direct && settings->io != PCM_TTY_IO_shm)
+      m_debug("io mode ignored, v253 mode always uses shm\n");
+    settings->io = PCM_TTY_IO_shm;
+    if(!settings->samplerate)
+      settings->samplerate = 8000;
   }else{
-    if(stream == SND_PCM_STREAM_CAPTURE){
-      cfsetispeed(&termios, baudin);
-      cfsetospeed(&termios, baudin);
-    }else{
-      cfsetispeed(&termios, baudout);
-      cfsetospeed(&termios, baudout);
-    }
-  }
-
-/*
-  if(!settings->iflag)
-    termios.c_iflag = settings->iflag;
-  if(!settings->oflag)
-    termios.c_oflag = settings->oflag;
-  if(!settings->iflag)
-    termios.c_lflag = settings->lflag;
-  if(!settings->iflag)
-    termios.c_cflag = settings->cflag;
-*/
-
-  // The following options aren't used in non-blocking mode
-  termios.c_cc[VMIN]  = 0;
-  termios.c_cc[VTIME] = 1;
-
-  cfmakeraw(&termios);
-
-  if(tcsetattr(device_fd, TCSANOW, &termios) != 0){
-    error = -errno;
-    SNDERR("tcsetattr failed");
-    goto backout_dev_open;
-  }
-  {
-    struct termios check;
-    if(tcgetattr(device_fd, &check) != 0){
-      error = -errno;
-      SNDERR("tcgetattr failed");
-      goto backout_dev_open;
-    }
-    if( cfgetispeed(&termios) != cfgetispeed(&check)
-     || cfgetospeed(&termios) != cfgetospeed(&check)
-    ){
-      SNDERR("Failed to set baud rate");
+    if(settings->io == PCM_TTY_IO_shm){
+      SNDERR("io mode shm is only available in v253 mode");
       error = -EINVAL;
-      goto backout_dev_open;
-    }
-  }
-
-  if(settings->mode == PCM_TTY_MODE_v253){
-    char shm_name[32] = {0};
-    snprintf(shm_name, 32, "tty-pcm:%x.%x", (int)(major(ttystat.st_rdev)), (int)(minor(ttystat.st_rdev)));
-    shm_fd = shm_open(shm_name, O_RDONLY, 0666);
-    if(shm_fd == -1){
-      error = errno;
-      SNDERR("shm_open failed");
-      goto backout_dev_open;
+      goto backout;
     }
-/*    if(ftruncate(shm_fd, 4096) == -1){
-      error = errno;
-      SNDERR("ftruncate failed");
-      close(shm_fd);
-      goto backout_dev_open;
-    }*/
-    shm = mmap(0, 4096, PROT_READ, MAP_SHARED, shm_fd, 0);
-    if(shm == MAP_FAILED){
-      error = -errno;
-      SNDERR("mmap failed\n");
-      close(shm_fd);
-      goto backout_dev_open;
+    device_fd = open_tty(settings, &s_playback, &s_capture, stream, &termios, &serial);
+    if(device_fd < 0){
+      error = device_fd;
+      device_fd = -1;
+      goto backout;
     }
-    close(shm_fd);
   }
-
   tty = calloc(1, sizeof(*tty));
   if(!tty){
     error = -errno;
     goto backout_dev_open;
   }
+  tty->timer_fd = -1;
 
   tty->settings = *settings;
-  tty->shm_fd = shm_fd;
-  tty->shm = shm;
+  memset(settings, 0, sizeof(*settings));
+  tty->frame_bytes = snd_pcm_format_physical_width(tty->settings.format) / 8 * tty->settings.channels;
+  if(tty->settings.io == PCM_TTY_IO_shm){
+    // The modem sends and receives the audio in real time
+    tty->byte_rate = tty->settings.samplerate * tty->frame_bytes;
+  }else{
+    tty->byte_rate = tty->settings.baudrate / pcm_tty_char_bits(termios.c_cflag);
+  }
   tty->ioplug.version = SND_PCM_IOPLUG_VERSION;
   tty->ioplug.name = "TTY sound device";
-  tty->ioplug.flags = SND_PCM_IOPLUG_FLAG_BOUNDARY_WA;
+  // The arrival times of captured data are taken from the same clock, see capture_delay.c
+  tty->ioplug.flags = SND_PCM_IOPLUG_FLAG_BOUNDARY_WA | SND_PCM_IOPLUG_FLAG_MONOTONIC;
   tty->ioplug.poll_fd = tty->device_fd = device_fd;
+  tty->serial_saved = serial;
   switch(stream){
     case SND_PCM_STREAM_PLAYBACK: {
-      tty->ioplug.callback = &IOPLUG_CALLBACKS_REF(playback);
       tty->ioplug.poll_events = POLLOUT;
     } break;
     case SND_PCM_STREAM_CAPTURE: {
-      tty->ioplug.callback = &IOPLUG_CALLBACKS_REF(capture);
       tty->ioplug.poll_events = POLLIN;
     } break;
   }
   tty->ioplug.private_data = tty;
 
+  tty->stream = stream;
+
+  if(tty->settings.trace){
+    error = pcm_tty_trace_open(tty);
+    if(error < 0)
+      goto backout_after_alloc;
+  }
+
+  if(tty->settings.stats){
+    error = pcm_tty_stats_open(tty);
+    if(error < 0)
+      goto backout_after_alloc;
+  }
+
+  if(tty->settings.io == PCM_TTY_IO_shm){
+    error = pcm_tty_shm_attach(tty);
+    if(error < 0)
+      goto backout_after_alloc;
+    // The daemon signals it whenever there is something to do
+    tty->ioplug.poll_fd = tty->shm_notify_fd;
+    tty->ioplug.poll_events = POLLIN;
+  }
+
+  error = buffer_limits(tty);
+  if(error < 0)
+    goto backout_after_alloc;
+
+  if(tty->settings.io == PCM_TTY_IO_thread || tty->settings.io == PCM_TTY_IO_uring){
+    // The ring must be able to hold the whole buffer
+    uint32_t ring_size = 64;
+    while(ring_size < tty->buffer_frames_max * tty->frame_bytes)
+      ring_size <<= 1;
+    tty->ring = malloc(sizeof(*tty->ring) + ring_size);
+    if(!tty->ring){
+      error = -errno;
+      goto backout_after_alloc;
+    }
+    pcm_tty_ring_init(tty->ring, ring_size);
+    tty->ring_size = ring_size;
+  }
+
+  if(tty->settings.io == PCM_TTY_IO_uring){
+    error = pcm_tty_uring_start(tty);
+    if(error < 0){
+      m_debug("io_uring unavailable (%s), falling back to direct io\n", strerror(-error));
+      free(tty->ring);
+      tty->ring = 0;
+      tty->settings.io = PCM_TTY_IO_direct;
+    }else{
+      // Readable whenever a read or write completed
+      tty->ioplug.poll_fd = pcm_tty_uring_fd(tty);
+      tty->ioplug.poll_events = POLLIN;
+    }
+  }
+
+  if(tty->settings.io == PCM_TTY_IO_thread){
+    error = pcm_tty_thread_start(tty);
+    if(error < 0)
+      goto backout_after_alloc;
+    // Signaled whenever the thread wrote or read something
+    tty->ioplug.poll_fd = tty->thread.notify_fd;
+    tty->ioplug.poll_events = POLLIN;
+  }
+
+  if(tty->settings.resample && tty->settings.io != PCM_TTY_IO_direct){
+    m_debug("resample ignored, it's only available in direct io mode\n");
+    tty->settings.resample = false;
+  }
+
+  if(tty->settings.io == PCM_TTY_IO_direct){
+    error = pcm_tty_timer_open(tty);
+    if(error < 0){
+      SNDERR("timerfd_create failed");
+      goto backout_after_alloc;
+    }
+  }
+
+  tty->ioplug.callback = transfer_callbacks_get(tty);
+
   error = snd_pcm_ioplug_create(&tty->ioplug, name, stream, mode);
   if(error < 0)
     goto backout_after_alloc;
 
   error = pcm_tty_configure(&tty->ioplug);
-  if(error < 0)
-    goto backout_after_snd_pcm_ioplug_create;
+  if(error < 0){
+    // This calls the close callback, which frees everything tty owns
+    snd_pcm_ioplug_delete(&tty->ioplug);
+    goto backout;
+  }
 
+  free_settings(&s_capture);
+  free_settings(&s_playback);
   *pcmp = tty->ioplug.pcm;
   return 0;
 
-backout_after_snd_pcm_ioplug_create:
-  snd_pcm_ioplug_delete(&tty->ioplug);
 backout_after_alloc:
+  pcm_tty_thread_stop(tty);
+  pcm_tty_uring_stop(tty);
+  pcm_tty_shm_detach(tty);
+  pcm_tty_timer_close(tty);
+  pcm_tty_trace_close(tty);
+  pcm_tty_stats_close(tty);
+  free(tty->ring);
+  free_settings(&tty->settings);
   free(tty);
 backout_dev_open:
-  close(device_fd);
+  if(device_fd != -1){
+    pcm_tty_serial_restore(device_fd, &serial);
+    close(device_fd);
+  }
 backout:
   free_settings(&s_both);
   free_settings(&s_capture);
@@ -0,0 +1,82 @@
+// Copyright (c) 2019 Daniel Abrecht
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include <libasound_module_pcm_tty.h>
+
+#include <sys/timerfd.h>
+
+
+// In direct io mode, the tty becomes ready whenever a few bytes got through,
+// which is way too often at low baud rates. So poll a timer which expires
+// once per period instead, and the tty only for errors and hangups.
+
+int pcm_tty_timer_open(struct tty_snd_plug* tty){
+  tty->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  if(tty->timer_fd == -1)
+    return -errno;
+  return 0;
+}
+
+void pcm_tty_timer_close(struct tty_snd_plug* tty){
+  if(tty->timer_fd == -1)
+    return;
+  close(tty->timer_fd);
+  tty->timer_fd = -1;
+}
+
+// Expires every time a period worth of data went over the line
+int pcm_tty_timer_arm(struct tty_snd_plug* tty){
+  if(tty->timer_fd == -1)
+    return 0;
+  uint64_t ns;
+  if(tty->resampler.active){
+    ns = (uint64_t)tty->ioplug.period_size * 1000000000 / tty->ioplug.rate;
+  }else{
+    ns = (uint64_t)tty->ioplug.period_size * tty->frame_bytes * 1000000000 / tty->byte_rate;
+  }
+  if(!ns)
+    ns = 1;
+  struct itimerspec its = {
+    .it_interval = { .tv_sec = ns / 1000000000, .tv_nsec = ns % 1000000000 },
+  };
+  its.it_value = its.it_interval;
+  if(timerfd_settime(tty->timer_fd, 0, &its, 0) == -1)
+    return -errno;
+  return 0;
+}
+
+void pcm_tty_timer_disarm(struct tty_snd_plug* tty){
+  if(tty->timer_fd == -1)
+    return;
+  struct itimerspec its = {0};
+  timerfd_settime(tty->timer_fd, 0, &its, 0);
+}
+
+int pcm_tty_poll_descriptors_count(struct tty_snd_plug* tty){
+  return tty->timer_fd != -1 ? 2 : 1;
+}
+
+int pcm_tty_poll_descriptors(struct tty_snd_plug* tty, struct pollfd* pfd, unsigned space){
+  if(tty->timer_fd == -1){
+    if(space < 1)
+      return -EINVAL;
+    pfd[0] = (struct pollfd){ .fd = tty->ioplug.poll_fd, .events = tty->ioplug.poll_events };
+    return 1;
+  }
+  if(space < 2)
+    return -EINVAL;
+  pfd[0] = (struct pollfd){ .fd = tty->timer_fd, .events = POLLIN };
+  pfd[1] = (struct pollfd){ .fd = tty->device_fd, .events = 0 };
+  return 2;
+}
+
+// Turns the timer and tty events into what the application waits for
+unsigned short pcm_tty_timer_revents(struct tty_snd_plug* tty, const struct pollfd* pfd){
+  unsigned short events = pfd[1].revents & (POLLERR | POLLHUP | POLLNVAL);
+  if(pfd[0].revents & POLLIN){
+    uint64_t count;
+    while(read(tty->timer_fd, &count, sizeof(count)) == -1 && errno == EINTR);
+    events |= tty->ioplug.poll_events;
+  }
+  return events;
+}
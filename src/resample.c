@@ -0,0 +1,267 @@
+// Copyright (c) 2019 Daniel Abrecht
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include <libasound_module_pcm_tty.h>
+
+#include <string.h>
+#include <time.h>
+
+
+// A UART rarely runs at exactly the rate its baud rate suggests, and neither does the other end.
+// The resampler measures how fast the line actually drains or fills, and converts between that
+// and the sample rate. On top of that, it slowly pulls the delay back to where it was at the start,
+// so whatever error is left over doesn't add up to an underrun or overrun over time.
+
+static const double window_time = 1; // s, how long the line rate is measured for at a time
+static const double smoothing = 0.1; // How much each measurement changes the line rate
+static const double gain = 0.05; // Rate correction per second of delay error
+static const double correction_max = 0.005; // The most the rate is corrected by, 0.5%
+
+static void to_s16(const struct pcm_tty_convert* convert, int16_t* dst, const void* src, size_t count){
+  if(convert->app_to_s16){
+    convert->app_to_s16(dst, src, count);
+  }else{
+    memcpy(dst, src, count * sizeof(int16_t));
+  }
+}
+
+static void from_s16(const struct pcm_tty_convert* convert, void* dst, const int16_t* src, size_t count){
+  if(convert->s16_to_app){
+    convert->s16_to_app(dst, src, count);
+  }else{
+    memcpy(dst, src, count * sizeof(int16_t));
+  }
+}
+
+// Linear interpolation, which is plenty for what fits through a serial line.
+// Returns the frames put into out, used is set to the input frames consumed.
+static size_t resample(struct pcm_tty_resampler* r, unsigned channels, int16_t* out, size_t out_max, const int16_t* in, size_t in_frames, size_t* used){
+  size_t i = 0, o = 0;
+  while(true){
+    while(r->position >= 1){
+      if(i >= in_frames)
+        goto done;
+      memcpy(r->previous, in + i * channels, channels * sizeof(int16_t));
+      r->position -= 1;
+      i++;
+    }
+    if(i >= in_frames || o >= out_max)
+      break;
+    const int16_t* next = in + i * channels;
+    for(unsigned c=0; c<channels; c++)
+      out[o * channels + c] = r->previous[c] + (int16_t)((next[c] - r->previous[c]) * r->position);
+    r->position += r->step;
+    o++;
+  }
+done:
+  *used = i;
+  return o;
+}
+
+// The step if the line ran at the given rate
+static double base_step(const struct tty_snd_plug* tty, double line_rate){
+  double line_frames = line_rate / tty->frame_bytes;
+  if(tty->stream == SND_PCM_STREAM_PLAYBACK)
+    return tty->ioplug.rate / line_frames;
+  return line_frames / tty->ioplug.rate;
+}
+
+// The rate the line should run at. Playback drains as fast as the baud rate allows,
+// but the other end only fills a capture line as fast as its sample rate.
+static double nominal_line_rate(const struct tty_snd_plug* tty){
+  if(tty->stream == SND_PCM_STREAM_PLAYBACK)
+    return tty->byte_rate;
+  return (double)tty->ioplug.rate * tty->frame_bytes;
+}
+
+void pcm_tty_resample_reset(struct tty_snd_plug* tty){
+  struct pcm_tty_resampler* r = &tty->resampler;
+  // What was measured about the line is still true, everything else belongs to the previous run
+  r->step = base_step(tty, r->line_rate ? r->line_rate : nominal_line_rate(tty));
+  r->position = 1;
+  memset(r->previous, 0, sizeof(r->previous));
+  r->line_bytes = 0;
+  r->measuring = false;
+  r->target_delay = -1;
+  r->pending = 0;
+  r->pending_offset = 0;
+}
+
+// Converts frames on the line to frames at the sample rate
+snd_pcm_sframes_t pcm_tty_resample_app_frames(const struct tty_snd_plug* tty, size_t line_frames){
+  if(tty->stream == SND_PCM_STREAM_PLAYBACK)
+    return line_frames * tty->resampler.step;
+  return line_frames / tty->resampler.step;
+}
+
+// Called with the bytes in the tty queue whenever the pointer is updated
+void pcm_tty_resample_update(struct tty_snd_plug* tty, int queued){
+  struct pcm_tty_resampler* r = &tty->resampler;
+  snd_pcm_ioplug_t* io = &tty->ioplug;
+  bool playback = tty->stream == SND_PCM_STREAM_PLAYBACK;
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  // Queued playback data has yet to go over the line, queued captured data already did
+  uint64_t line_bytes = playback ? r->line_bytes - queued : r->line_bytes + queued;
+  snd_pcm_sframes_t delay;
+  if(playback){
+    delay = snd_pcm_ioplug_hw_avail(io, tty->virtual_offset, io->appl_ptr)
+          + pcm_tty_resample_app_frames(tty, (queued + r->pending) / tty->frame_bytes);
+  }else{
+    delay = snd_pcm_ioplug_avail(io, tty->virtual_offset, io->appl_ptr)
+          + pcm_tty_resample_app_frames(tty, r->pending + queued / tty->frame_bytes);
+  }
+  if(!r->measuring){
+    r->measuring = true;
+    r->window_valid = true;
+    r->window_start = now;
+    r->window_bytes = line_bytes;
+    r->window_delay = 0;
+    r->window_samples = 0;
+  }
+  // A drained playback queue means the line was idle for a bit, which says nothing about its rate
+  if(playback && !queued)
+    r->window_valid = false;
+  r->window_delay += delay;
+  r->window_samples++;
+  double elapsed = (now.tv_sec - r->window_start.tv_sec) + (now.tv_nsec - r->window_start.tv_nsec) / 1e9;
+  if(elapsed < window_time)
+    return;
+
+  if(r->window_valid){
+    double rate = (line_bytes - r->window_bytes) / elapsed;
+    // Anything too far off is a stalled line or a sender which stopped, not a slightly off clock
+    double nominal = nominal_line_rate(tty);
+    if(rate > nominal / 2 && rate < nominal * 2)
+      r->line_rate = r->line_rate ? r->line_rate + (rate - r->line_rate) * smoothing : rate;
+  }
+  double average_delay = r->window_delay / r->window_samples;
+  r->window_valid = true;
+  r->window_start = now;
+  r->window_bytes = line_bytes;
+  r->window_delay = 0;
+  r->window_samples = 0;
+  if(!r->line_rate)
+    return;
+
+  // Once the rate is known, keep the delay it was running with
+  if(r->target_delay < 0)
+    r->target_delay = average_delay;
+  double correction = gain * (average_delay - r->target_delay) / io->rate;
+  if(correction > correction_max)
+    correction = correction_max;
+  if(correction < -correction_max)
+    correction = -correction_max;
+  r->step = base_step(tty, r->line_rate) * (1 + correction);
+  pcm_tty_trace(tty, PCM_TTY_TRACE_resample, (r->step - 1) * 1000000, r->line_rate);
+  m_debug("resample: line rate %.2f, delay %.1f, target %.1f, step %f\n", r->line_rate, average_delay, r->target_delay, r->step);
+}
+
+// Writes as much as possible, returns the bytes written
+static size_t line_write(struct tty_snd_plug* tty, const uint8_t* data, size_t size){
+  ssize_t s, os = size;
+  while(os && (s=write(tty->device_fd, data, os))>0){
+    os -= s;
+    data += s;
+  }
+  pcm_tty_stats_add(tty->stats, PCM_TTY_STATS_bytes_written, size - os);
+  if(os){
+    pcm_tty_stats_add(tty->stats, PCM_TTY_STATS_short_writes, 1);
+    pcm_tty_trace(tty, PCM_TTY_TRACE_short_io, size, size - os);
+  }
+  return size - os;
+}
+
+// Reads as much as available, returns the bytes read
+static size_t line_read(struct tty_snd_plug* tty, uint8_t* data, size_t size){
+  ssize_t s, os = size;
+  while(os && (s=read(tty->device_fd, data, os))>0){
+    os -= s;
+    data += s;
+  }
+  pcm_tty_stats_add(tty->stats, PCM_TTY_STATS_bytes_read, size - os);
+  if(os){
+    pcm_tty_stats_add(tty->stats, PCM_TTY_STATS_short_reads, 1);
+    pcm_tty_trace(tty, PCM_TTY_TRACE_short_io, size, size - os);
+  }
+  return size - os;
+}
+
+// Returns the frames taken from src. What's converted already but didn't fit into the tty is kept for next time.
+snd_pcm_sframes_t pcm_tty_resample_write(struct tty_snd_plug* tty, const void* src, size_t frames){
+  struct pcm_tty_resampler* r = &tty->resampler;
+  unsigned channels = tty->ioplug.channels;
+  size_t in_max = PCM_TTY_RESAMPLE_SAMPLES / 2 / channels;
+  size_t out_max = PCM_TTY_RESAMPLE_SAMPLES / channels;
+  size_t taken = 0;
+  while(true){
+    if(r->pending){
+      size_t w = line_write(tty, r->buffer.line + r->pending_offset, r->pending);
+      r->line_bytes += w;
+      r->pending_offset += w;
+      r->pending -= w;
+      if(r->pending)
+        break;
+    }
+    if(taken >= frames)
+      break;
+    // Take no more than fits into the output after resampling
+    size_t n = (out_max - 2) * r->step;
+    if(n > in_max)
+      n = in_max;
+    if(n > frames - taken)
+      n = frames - taken;
+    if(!n)
+      n = 1;
+    int16_t in[PCM_TTY_RESAMPLE_SAMPLES / 2];
+    int16_t out[PCM_TTY_RESAMPLE_SAMPLES];
+    to_s16(&tty->convert, in, (const uint8_t*)src + taken * tty->app_frame_bytes, n * channels);
+    size_t used;
+    size_t m = resample(r, channels, out, out_max, in, n, &used);
+    taken += used;
+    // Line format samples are single bytes
+    tty->convert.s16_to_line(r->buffer.line, out, m * channels);
+    r->pending_offset = 0;
+    r->pending = m * channels;
+  }
+  return taken;
+}
+
+// Returns the frames put into dst. Frames read but not needed yet are kept for next time.
+snd_pcm_sframes_t pcm_tty_resample_read(struct tty_snd_plug* tty, void* dst, size_t frames){
+  struct pcm_tty_resampler* r = &tty->resampler;
+  unsigned channels = tty->ioplug.channels;
+  size_t frames_max = PCM_TTY_RESAMPLE_SAMPLES / channels;
+  size_t frame_bytes = tty->frame_bytes;
+  size_t done = 0;
+  while(done < frames){
+    if(r->pending){
+      int16_t out[PCM_TTY_RESAMPLE_SAMPLES];
+      size_t out_max = frames - done < frames_max ? frames - done : frames_max;
+      size_t used;
+      size_t m = resample(r, channels, out, out_max, r->buffer.s16, r->pending, &used);
+      r->pending -= used;
+      memmove(r->buffer.s16, r->buffer.s16 + used * channels, r->pending * channels * sizeof(int16_t));
+      from_s16(&tty->convert, (uint8_t*)dst + done * tty->app_frame_bytes, out, m * channels);
+      done += m;
+      if(m == out_max)
+        continue;
+    }
+    // Everything read got used up, get more. The start of an incomplete frame is kept in partial_frame.
+    uint8_t line[PCM_TTY_RESAMPLE_SAMPLES];
+    memcpy(line, tty->partial_frame, tty->partial);
+    size_t s = line_read(tty, line + tty->partial, (frames_max - r->pending) * frame_bytes - tty->partial);
+    r->line_bytes += s;
+    if(s)
+      pcm_tty_arrived(tty);
+    size_t size = tty->partial + s;
+    size_t n = size / frame_bytes;
+    tty->partial = size % frame_bytes;
+    memcpy(tty->partial_frame, line + n * frame_bytes, tty->partial);
+    if(!n)
+      break;
+    tty->convert.line_to_s16(r->buffer.s16 + r->pending * channels, line, n * channels);
+    r->pending += n;
+  }
+  return done;
+}
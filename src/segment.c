@@ -0,0 +1,45 @@
+// Copyright (c) 2019 Daniel Abrecht
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include <pcm_tty_segment.h>
+
+#include <sys/mman.h>
+#include <sys/sysmacros.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdio.h>
+
+
+// Used by v253_splitter_daemon too, so this must not depend on alsa
+int pcm_tty_segment_create(const char* kind, dev_t rdev, const char* owner, mode_t mode, size_t size, char name[PCM_TTY_SEGMENT_NAME_MAX], void** segment){
+  int error = 0;
+  snprintf(name, PCM_TTY_SEGMENT_NAME_MAX, "%s:%d:%x.%x:%s",
+    kind, (int)getpid(), (int)(major(rdev)), (int)(minor(rdev)), owner
+  );
+  int fd = shm_open(name, O_RDWR | O_CREAT | O_TRUNC, mode);
+  if(fd == -1)
+    return -errno;
+  if(ftruncate(fd, size) == -1){
+    error = -errno;
+    goto backout;
+  }
+  void* mem = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if(mem == MAP_FAILED){
+    error = -errno;
+    goto backout;
+  }
+  close(fd);
+  *segment = mem;
+  return 0;
+
+backout:
+  close(fd);
+  shm_unlink(name);
+  return error;
+}
+
+void pcm_tty_segment_destroy(const char* name, void* segment, size_t size){
+  munmap(segment, size);
+  shm_unlink(name);
+}
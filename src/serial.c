@@ -0,0 +1,94 @@
+// Copyright (c) 2019 Daniel Abrecht
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include <libasound_module_pcm_tty.h>
+
+#include <linux/serial.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <limits.h>
+
+// USB serial adapters hold received data back for up to their latency timer, 16 ms by default,
+// and UARTs until their receive FIFO reaches its trigger level or times out.
+
+// Makes the driver pass received data on right away, or stop doing so. ftdi_sio also lowers its latency timer to 1 ms for this.
+// Returns 1 if the flag was changed, 0 if it already was as requested.
+int pcm_tty_serial_low_latency(int fd, bool enable){
+  struct serial_struct serial;
+  if(ioctl(fd, TIOCGSERIAL, &serial) == -1)
+    return -errno;
+  if(!(serial.flags & ASYNC_LOW_LATENCY) == !enable)
+    return 0;
+  serial.flags ^= ASYNC_LOW_LATENCY;
+  if(ioctl(fd, TIOCSSERIAL, &serial) == -1)
+    return -errno;
+  return 1;
+}
+
+static int attribute_open(int fd, const char* attribute, int flags){
+  struct stat st;
+  if(fstat(fd, &st) == -1)
+    return -errno;
+  char path[128];
+  snprintf(path, sizeof(path), "/sys/dev/char/%u:%u/%s", major(st.st_rdev), minor(st.st_rdev), attribute);
+  int attr_fd = open(path, flags | O_CLOEXEC);
+  if(attr_fd == -1)
+    return -errno;
+  return attr_fd;
+}
+
+// Writes a sysfs attribute of the tty, like rx_trig_bytes, or of its device, like device/latency_timer
+int pcm_tty_serial_attribute(int fd, const char* attribute, unsigned value){
+  int attr_fd = attribute_open(fd, attribute, O_WRONLY);
+  if(attr_fd < 0)
+    return attr_fd;
+  char buf[16];
+  int n = snprintf(buf, sizeof(buf), "%u\n", value);
+  int error = 0;
+  if(write(attr_fd, buf, n) == -1)
+    error = -errno;
+  close(attr_fd);
+  return error;
+}
+
+int pcm_tty_serial_attribute_get(int fd, const char* attribute, unsigned* value){
+  int attr_fd = attribute_open(fd, attribute, O_RDONLY);
+  if(attr_fd < 0)
+    return attr_fd;
+  char buf[16];
+  ssize_t n = read(attr_fd, buf, sizeof(buf) - 1);
+  int error = n == -1 ? -errno : 0;
+  close(attr_fd);
+  if(error)
+    return error;
+  buf[n] = 0;
+  char* end;
+  unsigned long v = strtoul(buf, &end, 10);
+  if(end == buf || v > UINT_MAX)
+    return -EINVAL;
+  *value = v;
+  return 0;
+}
+
+// The settings outlive the stream, so they're put back for whoever uses the tty next
+void pcm_tty_serial_restore(int fd, const struct pcm_tty_serial_saved* saved){
+  // First, clearing it may reset the latency timer
+  if(saved->low_latency){
+    int error = pcm_tty_serial_low_latency(fd, false);
+    if(error < 0)
+      m_debug("ASYNC_LOW_LATENCY not cleared: %s\n", strerror(-error));
+  }
+  if(saved->latency_timer){
+    int error = pcm_tty_serial_attribute(fd, "device/latency_timer", saved->latency_timer);
+    if(error < 0)
+      m_debug("latency_timer not restored: %s\n", strerror(-error));
+  }
+  if(saved->rx_trigger){
+    int error = pcm_tty_serial_attribute(fd, "rx_trig_bytes", saved->rx_trigger);
+    if(error < 0)
+      m_debug("rx_trigger not restored: %s\n", strerror(-error));
+  }
+}
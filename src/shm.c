@@ -0,0 +1,203 @@
+// Copyright (c) 2019 Daniel Abrecht
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include <libasound_module_pcm_tty.h>
+#include <pcm_tty_shm.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <stddef.h>
+#include <fcntl.h>
+
+
+// Tells the daemon our stream, and gets the notify and doorbell eventfds from it
+static int shm_connect(struct tty_snd_plug* tty, const char* name){
+  int error = 0;
+  struct sockaddr_un addr = { .sun_family = AF_UNIX };
+  size_t len = strlen(name);
+  memcpy(addr.sun_path + 1, name, len); // Abstract socket
+  int sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+  if(sock == -1){
+    error = -errno;
+    SNDERR("socket failed");
+    return error;
+  }
+  if(connect(sock, (struct sockaddr*)&addr, offsetof(struct sockaddr_un, sun_path) + 1 + len) == -1){
+    error = -errno;
+    SNDERR("Failed to connect to v253_splitter_daemon");
+    goto backout;
+  }
+  uint8_t stream = tty->stream == SND_PCM_STREAM_PLAYBACK ? PCM_TTY_SHM_STREAM_PLAYBACK : PCM_TTY_SHM_STREAM_CAPTURE;
+  if(send(sock, &stream, 1, MSG_NOSIGNAL) == -1){
+    error = -errno;
+    SNDERR("Failed to send the stream to v253_splitter_daemon");
+    goto backout;
+  }
+
+  uint8_t hello[2]; // version, errno
+  union {
+    struct cmsghdr cmsg;
+    char buf[CMSG_SPACE(2 * sizeof(int))];
+  } control;
+  struct iovec iov = { .iov_base = hello, .iov_len = sizeof(hello) };
+  struct msghdr msg = {
+    .msg_iov = &iov,
+    .msg_iovlen = 1,
+    .msg_control = control.buf,
+    .msg_controllen = sizeof(control.buf),
+  };
+  ssize_t s;
+  while((s = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC)) == -1 && errno == EINTR);
+  if(s == -1){
+    error = -errno;
+    SNDERR("Failed to get the eventfds of v253_splitter_daemon");
+    goto backout;
+  }
+  if(s != sizeof(hello) || hello[0] != PCM_TTY_SHM_VERSION){
+    SNDERR("v253_splitter_daemon sent an unexpected answer, the daemon is probably outdated");
+    error = -EPROTO;
+    goto backout;
+  }
+  if(hello[1]){
+    error = -hello[1];
+    if(hello[1] == EBUSY)
+      SNDERR("v253_splitter_daemon already has a %s stream", stream == PCM_TTY_SHM_STREAM_PLAYBACK ? "playback" : "capture");
+    else
+      SNDERR("v253_splitter_daemon refused the %s stream: %s", stream == PCM_TTY_SHM_STREAM_PLAYBACK ? "playback" : "capture", strerror(hello[1]));
+    goto backout;
+  }
+  struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+  if( !cmsg || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS || cmsg->cmsg_len != CMSG_LEN(2 * sizeof(int))){
+    SNDERR("v253_splitter_daemon didn't send the expected eventfds");
+    error = -EPROTO;
+    goto backout;
+  }
+  int fds[2];
+  memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+  tty->shm_socket = sock;
+  tty->shm_notify_fd = fds[0];
+  tty->shm_doorbell_fd = fds[1];
+  return 0;
+
+backout:
+  close(sock);
+  return error;
+}
+
+// Attaches to the rings of the v253_splitter_daemon which owns the tty
+int pcm_tty_shm_attach(struct tty_snd_plug* tty){
+  int error = 0;
+  struct stat ttystat;
+  if(stat(tty->settings.device, &ttystat) == -1){
+    error = -errno;
+    SNDERR("Failed to stat tty device (%s)", tty->settings.device);
+    return error;
+  }
+  if(!S_ISCHR(ttystat.st_mode)){
+    SNDERR("specified tty device file (%s) is not a character device file", tty->settings.device);
+    return -EINVAL;
+  }
+
+  char shm_name[32] = {0};
+  snprintf(shm_name, 32, "tty-pcm:%x.%x", (int)(major(ttystat.st_rdev)), (int)(minor(ttystat.st_rdev)));
+  int shm_fd = shm_open(shm_name, O_RDWR, 0666);
+  if(shm_fd == -1){
+    error = -errno;
+    SNDERR("shm_open failed, is v253_splitter_daemon running?");
+    return error;
+  }
+  struct stat shmstat;
+  if(fstat(shm_fd, &shmstat) == -1){
+    error = -errno;
+    SNDERR("fstat failed");
+    close(shm_fd);
+    return error;
+  }
+  if(shmstat.st_size < PCM_TTY_SHM_PAGE){
+    SNDERR("The shared memory of v253_splitter_daemon is too small, the daemon is probably outdated");
+    close(shm_fd);
+    return -EPROTO;
+  }
+  void* shm = mmap(0, shmstat.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, shm_fd, 0);
+  if(shm == MAP_FAILED){
+    error = -errno;
+    SNDERR("mmap failed");
+    close(shm_fd);
+    return error;
+  }
+  close(shm_fd);
+
+  struct pcm_tty_shm_control* control = shm;
+  if( __atomic_load_n(&control->magic, __ATOMIC_ACQUIRE) != PCM_TTY_SHM_MAGIC
+   || control->version != PCM_TTY_SHM_VERSION
+   || control->size > shmstat.st_size
+  ){
+    SNDERR("The shared memory of v253_splitter_daemon has an unknown layout, the daemon is probably outdated");
+    error = -EPROTO;
+    goto backout;
+  }
+  uint32_t offset = tty->stream == SND_PCM_STREAM_PLAYBACK ? control->playback_ring : control->capture_ring;
+  if(offset < sizeof(*control) || (uint64_t)offset + sizeof(struct pcm_tty_ring) > control->size){
+    SNDERR("The shared memory of v253_splitter_daemon is corrupt");
+    error = -EPROTO;
+    goto backout;
+  }
+  struct pcm_tty_ring* ring = pcm_tty_shm_ring(shm, offset);
+  // Only read it once, the ring accessors get this copy from now on
+  uint32_t ring_size = __atomic_load_n(&ring->size, __ATOMIC_RELAXED);
+  if(!ring_size || (ring_size & (ring_size - 1)) || (uint64_t)offset + sizeof(*ring) + ring_size > (uint64_t)shmstat.st_size){
+    SNDERR("The shared memory of v253_splitter_daemon is corrupt");
+    error = -EPROTO;
+    goto backout;
+  }
+
+  error = shm_connect(tty, shm_name);
+  if(error < 0)
+    goto backout;
+
+  tty->shm = shm;
+  tty->shm_size = shmstat.st_size;
+  tty->shm_seq = __atomic_load_n(&control->seq, __ATOMIC_ACQUIRE);
+  tty->ring = ring;
+  tty->ring_size = ring_size;
+  return 0;
+
+backout:
+  munmap(shm, shmstat.st_size);
+  return error;
+}
+
+void pcm_tty_shm_detach(struct tty_snd_plug* tty){
+  if(!tty->shm)
+    return;
+  close(tty->shm_doorbell_fd);
+  close(tty->shm_notify_fd);
+  close(tty->shm_socket);
+  munmap(tty->shm, tty->shm_size);
+  tty->shm = 0;
+  tty->ring = 0; // It was part of the shared memory
+}
+
+// Wakes the daemon up if it's waiting for playback audio
+void pcm_tty_shm_kick(struct tty_snd_plug* tty){
+  struct pcm_tty_shm_control* control = tty->shm;
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  if(!__atomic_load_n(&control->daemon_sleeping, __ATOMIC_SEQ_CST))
+    return;
+  uint64_t one = 1;
+  while(write(tty->shm_doorbell_fd, &one, sizeof(one)) == -1 && errno == EINTR);
+}
+
+void pcm_tty_shm_ack(struct tty_snd_plug* tty){
+  uint64_t count;
+  while(read(tty->shm_notify_fd, &count, sizeof(count)) == -1 && errno == EINTR);
+  struct pcm_tty_shm_control* control = tty->shm;
+  uint32_t seq = __atomic_load_n(&control->seq, __ATOMIC_ACQUIRE);
+  if(seq != tty->shm_seq){
+    tty->shm_seq = seq;
+    m_debug("modem is in %s mode now\n", __atomic_load_n(&control->state, __ATOMIC_ACQUIRE) == PCM_TTY_SHM_STATE_VOICE ? "voice" : "command");
+  }
+}
@@ -0,0 +1,26 @@
+// Copyright (c) 2019 Daniel Abrecht
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include <libasound_module_pcm_tty.h>
+#include <pcm_tty_stats.h>
+
+
+// Creates the stats segment of the stream, see pcm_tty_stats.h. Anyone may read it.
+int pcm_tty_stats_open(struct tty_snd_plug* tty){
+  void* mem;
+  int error = pcm_tty_segment_open(tty, "tty-pcm-stats", 0644, sizeof(struct pcm_tty_stats), tty->stats_name, &mem);
+  if(error < 0)
+    return error;
+  struct pcm_tty_stats* stats = mem;
+  stats->version = PCM_TTY_STATS_VERSION;
+  __atomic_store_n(&stats->magic, PCM_TTY_STATS_MAGIC, __ATOMIC_RELEASE);
+  tty->stats = stats;
+  return 0;
+}
+
+void pcm_tty_stats_close(struct tty_snd_plug* tty){
+  if(!tty->stats)
+    return;
+  pcm_tty_segment_destroy(tty->stats_name, tty->stats, sizeof(struct pcm_tty_stats));
+  tty->stats = 0;
+}
@@ -0,0 +1,213 @@
+// Copyright (c) 2019 Daniel Abrecht
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include <libasound_module_pcm_tty.h>
+
+#include <sys/eventfd.h>
+#include <signal.h>
+#include <fcntl.h>
+
+
+static void thread_notify(struct tty_snd_plug* tty){
+  uint64_t one = 1;
+  while(write(tty->thread.notify_fd, &one, sizeof(one)) == -1 && errno == EINTR);
+}
+
+// Gives up on the tty. The pointer and poll_revents callbacks report the error from now on.
+static void* thread_fail(struct tty_snd_plug* tty, int error){
+  __atomic_store_n(&tty->thread.error, error, __ATOMIC_RELEASE);
+  thread_notify(tty);
+  return 0;
+}
+
+// Waits until woken up, or, if device is set, until the device is ready too
+static int thread_wait(struct tty_snd_plug* tty, bool device, int timeout){
+  struct pollfd fds[] = {
+    { .fd = tty->thread.wake_fd, .events = POLLIN },
+    { .fd = tty->device_fd, .events = tty->stream == SND_PCM_STREAM_PLAYBACK ? POLLOUT : POLLIN },
+  };
+  if(poll(fds, 1 + device, timeout) == -1 && errno != EINTR)
+    return -errno;
+  if(fds[0].revents & POLLIN){
+    uint64_t count;
+    while(read(tty->thread.wake_fd, &count, sizeof(count)) == -1 && errno == EINTR);
+  }
+  return 0;
+}
+
+// Sleeps until the application has something for us
+static int thread_sleep(struct tty_snd_plug* tty){
+  __atomic_store_n(&tty->thread.sleeping, true, __ATOMIC_SEQ_CST);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  int ret = 0;
+  if(!pcm_tty_ring_fill(tty->ring) && !__atomic_load_n(&tty->thread.stop, __ATOMIC_ACQUIRE))
+    ret = thread_wait(tty, false, -1);
+  __atomic_store_n(&tty->thread.sleeping, false, __ATOMIC_SEQ_CST);
+  return ret;
+}
+
+static void* playback_thread(void* arg){
+  struct tty_snd_plug* tty = arg;
+  struct pcm_tty_ring* ring = tty->ring;
+  while(!__atomic_load_n(&tty->thread.stop, __ATOMIC_ACQUIRE)){
+    int32_t drop = __atomic_load_n(&tty->ring_drop, __ATOMIC_ACQUIRE) - pcm_tty_ring_read_position(ring);
+    if(drop > 0)
+      pcm_tty_ring_consume(ring, drop);
+    const uint8_t* data;
+    size_t n = pcm_tty_ring_peek(ring, tty->ring_size, &data);
+    if(!n){
+      int error = thread_sleep(tty);
+      if(error)
+        return thread_fail(tty, error);
+      continue;
+    }
+    ssize_t s = write(tty->device_fd, data, n);
+    if(s == -1){
+      int error = -errno;
+      if(error == -EINTR)
+        continue;
+      if(error == -EAGAIN){
+        pcm_tty_stats_add(tty->stats, PCM_TTY_STATS_eagain, 1);
+        pcm_tty_trace(tty, PCM_TTY_TRACE_eagain, n, 0);
+        error = thread_wait(tty, true, -1);
+        if(error)
+          return thread_fail(tty, error);
+        continue;
+      }
+      SNDERR("write to tty device failed: %s", strerror(-error));
+      return thread_fail(tty, error);
+    }
+    pcm_tty_stats_add(tty->stats, PCM_TTY_STATS_bytes_written, s);
+    if((size_t)s < n){
+      pcm_tty_stats_add(tty->stats, PCM_TTY_STATS_short_writes, 1);
+      pcm_tty_trace(tty, PCM_TTY_TRACE_short_io, n, s);
+    }
+    pcm_tty_ring_consume(ring, s);
+    thread_notify(tty);
+  }
+  return 0;
+}
+
+static void* capture_thread(void* arg){
+  struct tty_snd_plug* tty = arg;
+  struct pcm_tty_ring* ring = tty->ring;
+  uint8_t buf[1024];
+  while(!__atomic_load_n(&tty->thread.stop, __ATOMIC_ACQUIRE)){
+    uint8_t* dst;
+    size_t n = pcm_tty_ring_reserve(ring, tty->ring_size, &dst);
+    if(!n){
+      // The ring is full, the data is lost either way, but poll must not keep returning right away
+      dst = buf;
+      n = sizeof(buf);
+    }
+    ssize_t s = read(tty->device_fd, dst, n);
+    if(s == -1){
+      int error = -errno;
+      if(error == -EINTR)
+        continue;
+      if(error == -EAGAIN){
+        pcm_tty_stats_add(tty->stats, PCM_TTY_STATS_eagain, 1);
+        pcm_tty_trace(tty, PCM_TTY_TRACE_eagain, n, 0);
+        error = thread_wait(tty, true, -1);
+        if(error)
+          return thread_fail(tty, error);
+        continue;
+      }
+      // A tty which went away returns EIO
+      if(error == -EIO)
+        return thread_fail(tty, -ENODEV);
+      SNDERR("read from tty device failed: %s", strerror(-error));
+      return thread_fail(tty, error);
+    }
+    if(!s){
+      // Either the tty hung up, or VMIN is 0 and there just wasn't anything yet
+      struct pollfd pfd = { .fd = tty->device_fd, .events = POLLIN };
+      if(poll(&pfd, 1, 0) == 1 && (pfd.revents & (POLLHUP | POLLERR)))
+        return thread_fail(tty, -ENODEV);
+      int error = thread_wait(tty, true, -1);
+      if(error)
+        return thread_fail(tty, error);
+      continue;
+    }
+    pcm_tty_arrived(tty);
+    pcm_tty_stats_add(tty->stats, PCM_TTY_STATS_bytes_read, s);
+    if(dst != buf){
+      pcm_tty_ring_commit(ring, s);
+    }else{
+      pcm_tty_stats_add(tty->stats, PCM_TTY_STATS_overrun_bytes, s);
+      pcm_tty_trace(tty, PCM_TTY_TRACE_overrun, s, 0);
+    }
+    thread_notify(tty);
+  }
+  return 0;
+}
+
+int pcm_tty_thread_error(const struct tty_snd_plug* tty){
+  return __atomic_load_n(&tty->thread.error, __ATOMIC_ACQUIRE);
+}
+
+void pcm_tty_thread_wake(struct tty_snd_plug* tty){
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  if(!__atomic_load_n(&tty->thread.sleeping, __ATOMIC_SEQ_CST))
+    return;
+  uint64_t one = 1;
+  while(write(tty->thread.wake_fd, &one, sizeof(one)) == -1 && errno == EINTR);
+}
+
+int pcm_tty_thread_start(struct tty_snd_plug* tty){
+  int error = 0;
+  struct pcm_tty_thread* thread = &tty->thread;
+  thread->stop = false;
+  thread->error = 0;
+  thread->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if(thread->wake_fd == -1){
+    error = -errno;
+    SNDERR("eventfd failed");
+    goto backout;
+  }
+  thread->notify_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if(thread->notify_fd == -1){
+    error = -errno;
+    SNDERR("eventfd failed");
+    goto backout_wake_fd;
+  }
+  // The thread waits on the device using poll, so it must never block
+  int flags = fcntl(tty->device_fd, F_GETFL);
+  if(flags == -1 || fcntl(tty->device_fd, F_SETFL, flags | O_NONBLOCK) == -1){
+    error = -errno;
+    SNDERR("fcntl failed");
+    goto backout_notify_fd;
+  }
+  // Signals are for the application threads
+  sigset_t all, old;
+  sigfillset(&all);
+  pthread_sigmask(SIG_SETMASK, &all, &old);
+  error = -pthread_create(&thread->id, 0, tty->stream == SND_PCM_STREAM_PLAYBACK ? playback_thread : capture_thread, tty);
+  pthread_sigmask(SIG_SETMASK, &old, 0);
+  if(error){
+    SNDERR("pthread_create failed");
+    goto backout_notify_fd;
+  }
+  thread->running = true;
+  return 0;
+
+backout_notify_fd:
+  close(thread->notify_fd);
+backout_wake_fd:
+  close(thread->wake_fd);
+backout:
+  return error;
+}
+
+void pcm_tty_thread_stop(struct tty_snd_plug* tty){
+  struct pcm_tty_thread* thread = &tty->thread;
+  if(!thread->running)
+    return;
+  __atomic_store_n(&thread->stop, true, __ATOMIC_RELEASE);
+  uint64_t one = 1;
+  while(write(thread->wake_fd, &one, sizeof(one)) == -1 && errno == EINTR);
+  pthread_join(thread->id, 0);
+  thread->running = false;
+  close(thread->notify_fd);
+  close(thread->wake_fd);
+}
@@ -0,0 +1,44 @@
+// Copyright (c) 2019 Daniel Abrecht
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include <libasound_module_pcm_tty.h>
+#include <pcm_tty_trace.h>
+
+
+// Creates the trace segment of the stream, see pcm_tty_trace.h
+int pcm_tty_trace_open(struct tty_snd_plug* tty){
+  size_t size = pcm_tty_trace_size(PCM_TTY_TRACE_RECORDS);
+  void* mem;
+  int error = pcm_tty_segment_open(tty, "tty-pcm-trace", 0600, size, tty->trace_name, &mem);
+  if(error < 0)
+    return error;
+  struct pcm_tty_trace* trace = mem;
+  trace->version = PCM_TTY_TRACE_VERSION;
+  trace->records = PCM_TTY_TRACE_RECORDS;
+  __atomic_store_n(&trace->magic, PCM_TTY_TRACE_MAGIC, __ATOMIC_RELEASE);
+  tty->trace = trace;
+  return 0;
+}
+
+void pcm_tty_trace_close(struct tty_snd_plug* tty){
+  if(!tty->trace)
+    return;
+  pcm_tty_segment_destroy(tty->trace_name, tty->trace, pcm_tty_trace_size(tty->trace->records));
+  tty->trace = 0;
+}
+
+// Takes the next record, overwriting the oldest one. Safe to call from the io thread too.
+void pcm_tty_trace(struct tty_snd_plug* tty, unsigned event, int64_t a, int64_t b){
+  struct pcm_tty_trace* trace = tty->trace;
+  if(!trace)
+    return;
+  uint32_t index = __atomic_fetch_add(&trace->head, 1, __ATOMIC_RELAXED);
+  struct pcm_tty_trace_record* record = &trace->record[index & (trace->records - 1)];
+  __atomic_store_n(&record->seq, 0, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  record->event = event;
+  record->time = pcm_tty_now();
+  record->a = a;
+  record->b = b;
+  __atomic_store_n(&record->seq, index + 1, __ATOMIC_RELEASE);
+}
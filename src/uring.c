@@ -0,0 +1,318 @@
+// Copyright (c) 2019 Daniel Abrecht
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include <libasound_module_pcm_tty.h>
+
+#include <fcntl.h>
+
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define PCM_TTY_HAVE_URING
+#endif
+#endif
+
+#ifdef PCM_TTY_HAVE_URING
+
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+
+enum { URING_BUFFER_SIZE = 4096 };
+
+struct pcm_tty_uring {
+  int fd;
+  void* sq_map;
+  size_t sq_map_size;
+  void* cq_map;
+  size_t cq_map_size;
+  struct io_uring_sqe* sqes;
+  size_t sqes_size;
+  unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+  unsigned *cq_head, *cq_tail, *cq_mask;
+  struct io_uring_cqe* cqes;
+  bool busy; // There is always at most one read or write in flight, so the data stays in order
+  bool direct; // The read goes straight into the ring
+  bool hangup;
+  int error; // Negative errno of a failed read or write, nothing is submitted anymore after one
+  uint8_t buf[URING_BUFFER_SIZE]; // For reads while the ring is full
+};
+
+static int uring_enter(struct pcm_tty_uring* uring, unsigned submit, unsigned complete){
+  int ret;
+  do {
+    ret = syscall(__NR_io_uring_enter, uring->fd, submit, complete, complete ? IORING_ENTER_GETEVENTS : 0, 0, 0);
+  } while(ret == -1 && errno == EINTR);
+  return ret == -1 ? -errno : ret;
+}
+
+static int uring_submit(struct pcm_tty_uring* uring, int opcode, int fd, void* data, size_t size, uint64_t user_data){
+  unsigned tail = *uring->sq_tail;
+  unsigned index = tail & *uring->sq_mask;
+  struct io_uring_sqe* sqe = &uring->sqes[index];
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode = opcode;
+  sqe->fd = fd;
+  sqe->addr = (uintptr_t)data;
+  sqe->len = size;
+  sqe->user_data = user_data;
+  uring->sq_array[index] = index;
+  __atomic_store_n(uring->sq_tail, tail+1, __ATOMIC_RELEASE);
+  int ret = uring_enter(uring, 1, 0);
+  return ret < 0 ? ret : 1;
+}
+
+static void playback_complete(struct tty_snd_plug* tty, int res){
+  if(res < 0){
+    if(res == -EAGAIN)
+      pcm_tty_stats_add(tty->stats, PCM_TTY_STATS_eagain, 1);
+    if(res != -EAGAIN && res != -EINTR){
+      SNDERR("write to tty device failed: %s", strerror(-res));
+      tty->uring->error = res;
+    }
+    return;
+  }
+  pcm_tty_stats_add(tty->stats, PCM_TTY_STATS_bytes_written, res);
+  pcm_tty_ring_consume(tty->ring, res);
+}
+
+// These return 1 if something was submitted
+static int playback_post(struct tty_snd_plug* tty){
+  struct pcm_tty_ring* ring = tty->ring;
+  int32_t drop = tty->ring_drop - pcm_tty_ring_read_position(ring);
+  if(drop > 0)
+    pcm_tty_ring_consume(ring, drop);
+  const uint8_t* data;
+  size_t n = pcm_tty_ring_peek(ring, tty->ring_size, &data);
+  if(!n)
+    return 0;
+  return uring_submit(tty->uring, IORING_OP_WRITE, tty->device_fd, (void*)data, n, 0);
+}
+
+static void capture_complete(struct tty_snd_plug* tty, int res){
+  struct pcm_tty_uring* uring = tty->uring;
+  if(res < 0){
+    if(res == -EAGAIN)
+      pcm_tty_stats_add(tty->stats, PCM_TTY_STATS_eagain, 1);
+    if(res != -EAGAIN && res != -EINTR){
+      SNDERR("read from tty device failed: %s", strerror(-res));
+      uring->error = res == -EIO ? -ENODEV : res; // A tty which went away returns EIO
+    }
+    return;
+  }
+  if(!res){
+    // Either the tty hung up, or VTIME ran out
+    struct pollfd pfd = { .fd = tty->device_fd, .events = POLLIN };
+    if(poll(&pfd, 1, 0) == 1 && (pfd.revents & (POLLHUP | POLLERR))){
+      uring->error = -ENODEV;
+      return;
+    }
+    // Don't repost the read until the next update, or we'd spin
+    uring->hangup = true;
+    return;
+  }
+  pcm_tty_arrived(tty);
+  pcm_tty_stats_add(tty->stats, PCM_TTY_STATS_bytes_read, res);
+  if(uring->direct){
+    pcm_tty_ring_commit(tty->ring, res);
+  }else{
+    pcm_tty_stats_add(tty->stats, PCM_TTY_STATS_overrun_bytes, res);
+    pcm_tty_trace(tty, PCM_TTY_TRACE_overrun, res, 0);
+  }
+}
+
+static int capture_post(struct tty_snd_plug* tty){
+  struct pcm_tty_uring* uring = tty->uring;
+  if(uring->hangup){
+    uring->hangup = false;
+    return 0;
+  }
+  uint8_t* dst;
+  size_t n = pcm_tty_ring_reserve(tty->ring, tty->ring_size, &dst);
+  uring->direct = n;
+  if(!uring->direct){
+    dst = uring->buf;
+    n = sizeof(uring->buf);
+  }
+  return uring_submit(uring, IORING_OP_READ, tty->device_fd, dst, n, 0);
+}
+
+int pcm_tty_uring_update(struct tty_snd_plug* tty){
+  struct pcm_tty_uring* uring = tty->uring;
+  unsigned head = *uring->cq_head;
+  unsigned tail = __atomic_load_n(uring->cq_tail, __ATOMIC_ACQUIRE);
+  for(; head != tail; head++){
+    int res = uring->cqes[head & *uring->cq_mask].res;
+    uring->busy = false;
+    if(tty->stream == SND_PCM_STREAM_PLAYBACK){
+      playback_complete(tty, res);
+    }else{
+      capture_complete(tty, res);
+    }
+  }
+  __atomic_store_n(uring->cq_head, head, __ATOMIC_RELEASE);
+  if(uring->error)
+    return uring->error;
+  if(uring->busy)
+    return 0;
+  int ret = tty->stream == SND_PCM_STREAM_PLAYBACK ? playback_post(tty) : capture_post(tty);
+  if(ret < 0)
+    return ret;
+  uring->busy = ret;
+  return 0;
+}
+
+// IORING_OP_READ and IORING_OP_WRITE came with Linux 5.6, older kernels fail every one of them with EINVAL.
+// IORING_REGISTER_PROBE came with them, so if it's missing, so are they.
+static int uring_probe(struct pcm_tty_uring* uring){
+  size_t size = sizeof(struct io_uring_probe) + IORING_OP_LAST * sizeof(struct io_uring_probe_op);
+  struct io_uring_probe* probe = calloc(1, size);
+  if(!probe)
+    return -errno;
+  int error = 0;
+  if(syscall(__NR_io_uring_register, uring->fd, IORING_REGISTER_PROBE, probe, IORING_OP_LAST) == -1){
+    error = -errno;
+  }else{
+    static const int ops[] = { IORING_OP_READ, IORING_OP_WRITE };
+    for(size_t i=0; i<sizeof(ops)/sizeof(*ops); i++)
+      if(ops[i] > probe->last_op || !(probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED))
+        error = -EOPNOTSUPP;
+  }
+  free(probe);
+  return error;
+}
+
+int pcm_tty_uring_start(struct tty_snd_plug* tty){
+  int error = 0;
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  struct pcm_tty_uring* uring = calloc(1, sizeof(*uring));
+  if(!uring)
+    return -errno;
+  uring->fd = syscall(__NR_io_uring_setup, 4, &params);
+  if(uring->fd == -1){
+    error = -errno;
+    goto backout;
+  }
+  error = uring_probe(uring);
+  if(error < 0)
+    goto backout_fd;
+  uring->sq_map_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  uring->cq_map_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  if(params.features & IORING_FEAT_SINGLE_MMAP){
+    if(uring->cq_map_size > uring->sq_map_size)
+      uring->sq_map_size = uring->cq_map_size;
+    uring->cq_map_size = uring->sq_map_size;
+  }
+  uring->sq_map = mmap(0, uring->sq_map_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, uring->fd, IORING_OFF_SQ_RING);
+  if(uring->sq_map == MAP_FAILED){
+    error = -errno;
+    goto backout_fd;
+  }
+  if(params.features & IORING_FEAT_SINGLE_MMAP){
+    uring->cq_map = uring->sq_map;
+  }else{
+    uring->cq_map = mmap(0, uring->cq_map_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, uring->fd, IORING_OFF_CQ_RING);
+    if(uring->cq_map == MAP_FAILED){
+      error = -errno;
+      goto backout_sq_map;
+    }
+  }
+  uring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+  uring->sqes = mmap(0, uring->sqes_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, uring->fd, IORING_OFF_SQES);
+  if(uring->sqes == MAP_FAILED){
+    error = -errno;
+    goto backout_cq_map;
+  }
+  uint8_t* sq = uring->sq_map;
+  uint8_t* cq = uring->cq_map;
+  uring->sq_head  = (unsigned*)(sq + params.sq_off.head);
+  uring->sq_tail  = (unsigned*)(sq + params.sq_off.tail);
+  uring->sq_mask  = (unsigned*)(sq + params.sq_off.ring_mask);
+  uring->sq_array = (unsigned*)(sq + params.sq_off.array);
+  uring->cq_head  = (unsigned*)(cq + params.cq_off.head);
+  uring->cq_tail  = (unsigned*)(cq + params.cq_off.tail);
+  uring->cq_mask  = (unsigned*)(cq + params.cq_off.ring_mask);
+  uring->cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+
+  // io_uring returns EAGAIN for non-blocking files instead of waiting for them
+  int flags = fcntl(tty->device_fd, F_GETFL);
+  if(flags == -1 || fcntl(tty->device_fd, F_SETFL, flags & ~O_NONBLOCK) == -1){
+    error = -errno;
+    goto backout_sqes;
+  }
+
+  tty->uring = uring;
+  error = pcm_tty_uring_update(tty);
+  if(error < 0){
+    tty->uring = 0;
+    goto backout_sqes;
+  }
+  return 0;
+
+backout_sqes:
+  munmap(uring->sqes, uring->sqes_size);
+backout_cq_map:
+  if(uring->cq_map != uring->sq_map)
+    munmap(uring->cq_map, uring->cq_map_size);
+backout_sq_map:
+  munmap(uring->sq_map, uring->sq_map_size);
+backout_fd:
+  close(uring->fd);
+backout:
+  free(uring);
+  return error;
+}
+
+void pcm_tty_uring_stop(struct tty_snd_plug* tty){
+  struct pcm_tty_uring* uring = tty->uring;
+  if(!uring)
+    return;
+  if(uring->busy){
+    // The kernel must be done with our buffers before they are freed
+    if(uring_submit(uring, IORING_OP_ASYNC_CANCEL, -1, 0, 0, 1) > 0){
+      unsigned pending = 2; // The cancelled request and the cancellation
+      while(pending){
+        unsigned head = *uring->cq_head;
+        unsigned tail = __atomic_load_n(uring->cq_tail, __ATOMIC_ACQUIRE);
+        pending -= tail - head < pending ? tail - head : pending;
+        __atomic_store_n(uring->cq_head, tail, __ATOMIC_RELEASE);
+        if(pending && uring_enter(uring, 0, 1) < 0)
+          break;
+      }
+    }
+  }
+  munmap(uring->sqes, uring->sqes_size);
+  if(uring->cq_map != uring->sq_map)
+    munmap(uring->cq_map, uring->cq_map_size);
+  munmap(uring->sq_map, uring->sq_map_size);
+  close(uring->fd);
+  free(uring);
+  tty->uring = 0;
+}
+
+int pcm_tty_uring_fd(struct tty_snd_plug* tty){
+  return tty->uring->fd;
+}
+
+#else
+
+int pcm_tty_uring_start(struct tty_snd_plug* tty){
+  (void)tty;
+  return -ENOSYS;
+}
+
+void pcm_tty_uring_stop(struct tty_snd_plug* tty){
+  (void)tty;
+}
+
+int pcm_tty_uring_update(struct tty_snd_plug* tty){
+  (void)tty;
+  return -ENOSYS;
+}
+
+int pcm_tty_uring_fd(struct tty_snd_plug* tty){
+  (void)tty;
+  return -1;
+}
+
+#endif
@@ -1,4 +1,8 @@
 #include <libasound_module_pcm_tty.h>
+#include <pcm_tty_shm.h>
+
+#include <sys/ioctl.h>
+#include <sys/stat.h>
 
 int pcm_tty_indexof(const char* search, const char*const* list){
   for(int i=0; *list; list++, i++)
@@ -6,3 +10,82 @@ int pcm_tty_indexof(const char* search, const char*const* list){
       return i;
   return -1;
 }
+
+unsigned pcm_tty_char_bits(tcflag_t cflag){
+  unsigned bits = 1; // start bit
+  switch(cflag & CSIZE){
+    case CS5: bits += 5; break;
+    case CS6: bits += 6; break;
+    case CS7: bits += 7; break;
+    default : bits += 8; break;
+  }
+  if(cflag & PARENB)
+    bits += 1;
+  bits += cflag & CSTOPB ? 2 : 1;
+  return bits;
+}
+
+// Returns how many frames pass while size bytes are sent or received on the line
+snd_pcm_sframes_t pcm_tty_line_delay(const struct tty_snd_plug* tty, size_t size){
+  if(!tty->byte_rate)
+    return 0;
+  return (uint64_t)size * tty->ioplug.rate / tty->byte_rate;
+}
+
+// Returns how many bytes wait in the tty, to be sent for playback or to be read for capture.
+// v253_splitter_daemon publishes those of the modem, there is no tty of our own then.
+int pcm_tty_queued(const struct tty_snd_plug* tty){
+  if(tty->shm){
+    const struct pcm_tty_shm_control* control = tty->shm;
+    uint32_t queued = __atomic_load_n(tty->stream == SND_PCM_STREAM_PLAYBACK ? &control->modem_outq : &control->modem_inq, __ATOMIC_RELAXED);
+    return queued > INT_MAX ? INT_MAX : (int)queued;
+  }
+  int queued = 0;
+  if(ioctl(tty->device_fd, tty->stream == SND_PCM_STREAM_PLAYBACK ? TIOCOUTQ : TIOCINQ, &queued) == -1 || queued < 0)
+    return 0;
+  return queued;
+}
+
+// Returns how many frames can be sent or received on the line in the given time
+snd_pcm_uframes_t pcm_tty_line_frames(const struct tty_snd_plug* tty, unsigned ms){
+  // With the resampler, the frames are at the sample rate whatever the line does
+  if(tty->settings.resample)
+    return (uint64_t)ms * tty->settings.samplerate / 1000;
+  return (uint64_t)ms * tty->byte_rate / tty->frame_bytes / 1000;
+}
+
+// CLOCK_MONOTONIC in ns, ALSA takes the timestamps of the stream from the same clock
+uint64_t pcm_tty_now(void){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// To be called whenever captured data was read from the tty
+void pcm_tty_arrived(struct tty_snd_plug* tty){
+  __atomic_store_n(&tty->arrival, pcm_tty_now(), __ATOMIC_RELEASE);
+}
+
+// Returns how many frames passed since captured data last came in
+snd_pcm_sframes_t pcm_tty_since_arrival(const struct tty_snd_plug* tty){
+  uint64_t arrival = __atomic_load_n(&tty->arrival, __ATOMIC_ACQUIRE);
+  uint64_t now = pcm_tty_now();
+  if(!arrival || now <= arrival)
+    return 0;
+  return (now - arrival) * tty->ioplug.rate / 1000000000;
+}
+
+// Creates a segment named <kind>:<pid>:<major>.<minor>:<stream>, see pcm_tty_segment_create
+int pcm_tty_segment_open(struct tty_snd_plug* tty, const char* kind, mode_t mode, size_t size, char name[PCM_TTY_SEGMENT_NAME_MAX], void** segment){
+  struct stat ttystat;
+  if(stat(tty->settings.device, &ttystat) == -1){
+    int error = -errno;
+    SNDERR("Failed to stat tty device (%s)", tty->settings.device);
+    return error;
+  }
+  const char* owner = tty->stream == SND_PCM_STREAM_PLAYBACK ? "playback" : "capture";
+  int error = pcm_tty_segment_create(kind, ttystat.st_rdev, owner, mode, size, name, segment);
+  if(error < 0)
+    SNDERR("Failed to create the shared memory segment %s: %s", name, strerror(-error));
+  return error;
+}
@@ -0,0 +1,467 @@
+// Copyright (c) 2019 Daniel Abrecht
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include <sys/types.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdio.h>
+#include <ctype.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <signal.h>
+#include <time.h>
+#include <pty.h>
+#include <termios.h>
+#include <pcm_tty_dle.h>
+
+// A voice modem on a pty, for testing v253_splitter_daemon and the plugin without hardware.
+// Everything it sends and reads is paced at the baud rate, 10 bits per byte like 8N1, one tick at a time.
+// It answers AT commands with OK and enters voice mode on AT+VTR. In voice mode, it sends 8 bit samples
+// at the sample rate, DLE shielded, and takes the samples it gets until DLE ETX or DLE ! ends voice mode.
+// The samples sent are a ramp, which makes lost or mangled bytes easy to spot, or with -l,
+// whatever it got sent earlier.
+// Faults can be injected: lost samples, jitter of the line, and stalls during which the modem
+// neither sends nor reads anything. They come from a seeded PRNG, so each run with the same seed
+// misbehaves the same way.
+
+enum {
+  C_ETX = 0x03,
+  EVENTS_MAX = 16,
+  OUT_SIZE = 1<<16, // Bytes waiting to be sent, like the buffer of a real modem
+  LOOP_SIZE = 1<<16, // Samples waiting to be sent back with -l
+  BUFSIZE = 255,
+  SILENCE = 0x80
+};
+
+struct event {
+  unsigned ms; // After entering voice mode
+  uint8_t code;
+};
+
+struct settings {
+  unsigned baudrate;
+  unsigned samplerate;
+  unsigned tick_ms;
+  unsigned connect_ms; // Until ATD and ATA get their result
+  bool loopback;
+  unsigned drop_ppm; // Of the samples sent
+  unsigned jitter_ms;
+  unsigned stall_every_ms, stall_ms;
+  uint64_t seed;
+  unsigned event_count;
+  struct event event[EVENTS_MAX];
+};
+
+struct counters {
+  uint64_t bytes_sent;
+  uint64_t bytes_received;
+  uint64_t samples_sent;
+  uint64_t samples_received;
+  uint64_t samples_dropped; // Fault injection
+  uint64_t samples_lost; // The output buffer was full
+  uint64_t loopback_underruns; // Nothing to send back, sent silence instead
+  uint64_t events_sent;
+  uint64_t stalls;
+  uint64_t voice_sessions;
+};
+
+struct emulator {
+  struct settings settings;
+  struct counters counters;
+  int master, slave;
+  const char* link;
+  uint64_t rng;
+
+  bool echo;
+  char line[BUFSIZE+1];
+  size_t line_size;
+  char result[32]; // Delayed until result_due
+  uint64_t result_due;
+
+  bool voice;
+  bool dle; // The last byte received in voice mode was an unpaired DLE
+  uint64_t voice_start;
+  unsigned next_event;
+  uint8_t ramp;
+
+  uint8_t out[OUT_SIZE];
+  size_t out_start, out_end;
+  uint8_t loop[LOOP_SIZE];
+  size_t loop_read, loop_write;
+
+  // In bytes or samples. They don't add up while stalled or held back.
+  double tx_credit, rx_credit, sample_credit;
+  uint64_t hold_until; // Jitter
+  uint64_t stall_start, stall_end;
+};
+
+static volatile sig_atomic_t stop;
+
+static void on_signal(int sig){
+  (void)sig;
+  stop = true;
+}
+
+static uint64_t now(void){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// xorshift64*
+static uint64_t rng_next(struct emulator* e){
+  e->rng ^= e->rng >> 12;
+  e->rng ^= e->rng << 25;
+  e->rng ^= e->rng >> 27;
+  return e->rng * UINT64_C(2685821657736338717);
+}
+
+static size_t out_space(struct emulator* e){
+  if(e->out_start && e->out_end == OUT_SIZE){
+    memmove(e->out, e->out + e->out_start, e->out_end - e->out_start);
+    e->out_end -= e->out_start;
+    e->out_start = 0;
+  }
+  return OUT_SIZE - e->out_end;
+}
+
+static bool out_put(struct emulator* e, const void* data, size_t size){
+  if(out_space(e) < size)
+    return false;
+  memcpy(e->out + e->out_end, data, size);
+  e->out_end += size;
+  return true;
+}
+
+static void reply(struct emulator* e, const char* result){
+  char buf[64];
+  int n = snprintf(buf, sizeof(buf), "\r\n%s\r\n", result);
+  out_put(e, buf, n);
+}
+
+static void voice_begin(struct emulator* e, uint64_t t){
+  e->voice = true;
+  e->dle = false;
+  e->voice_start = t;
+  e->next_event = 0;
+  e->sample_credit = 0;
+  e->loop_read = e->loop_write = 0;
+  e->counters.voice_sessions++;
+}
+
+static void voice_end(struct emulator* e){
+  e->voice = false;
+  reply(e, "OK");
+}
+
+static void on_command(struct emulator* e, uint64_t t){
+  const char* cmd = e->line;
+  if(!strcmp(cmd, "ATE0") || !strcmp(cmd, "ATE1")){
+    e->echo = cmd[3] == '1';
+    reply(e, "OK");
+  }else if(!strcmp(cmd, "AT+VTR")){
+    reply(e, "CONNECT");
+    voice_begin(e, t);
+  }else if(!strncmp(cmd, "ATD", 3) || !strcmp(cmd, "ATA")){
+    snprintf(e->result, sizeof(e->result), "OK");
+    e->result_due = t + (uint64_t)e->settings.connect_ms * 1000000;
+  }else{
+    // ATH, AT+FCLASS=8 and whatever else there may be
+    reply(e, "OK");
+  }
+}
+
+static void command_input(struct emulator* e, uint8_t c, uint64_t t){
+  if(e->echo)
+    out_put(e, &c, 1);
+  if(c == '\n')
+    return;
+  if(c != '\r'){
+    if(e->line_size < BUFSIZE)
+      e->line[e->line_size++] = toupper(c);
+    return;
+  }
+  e->line[e->line_size] = 0;
+  e->line_size = 0;
+  if(strncmp(e->line, "AT", 2)){
+    if(e->line[0])
+      reply(e, "ERROR");
+    return;
+  }
+  on_command(e, t);
+}
+
+static void voice_sample(struct emulator* e, uint8_t c){
+  e->counters.samples_received++;
+  if(e->settings.loopback && e->loop_write - e->loop_read < LOOP_SIZE)
+    e->loop[e->loop_write++ % LOOP_SIZE] = c;
+}
+
+// Takes one byte of voice data sent to the modem
+static void voice_input(struct emulator* e, uint8_t c){
+  if(!e->dle){
+    if(c == C_DLE){
+      e->dle = true;
+      return;
+    }
+  }else{
+    e->dle = false;
+    switch(c){
+      case C_DLE: break;
+      case C_SUB: {
+        // Two DLE samples
+        voice_sample(e, C_DLE);
+        voice_sample(e, C_DLE);
+      } return;
+      case C_ETX: case '!': voice_end(e); return;
+      default: return; // Other events from the host are of no interest here
+    }
+  }
+  voice_sample(e, c);
+}
+
+static void receive(struct emulator* e, uint64_t t){
+  uint8_t buf[4096];
+  size_t n = e->rx_credit < sizeof(buf) ? e->rx_credit : sizeof(buf);
+  if(!n)
+    return;
+  ssize_t s = read(e->master, buf, n);
+  if(s <= 0)
+    return;
+  e->rx_credit -= s;
+  e->counters.bytes_received += s;
+  for(ssize_t i=0; i<s; i++){
+    if(e->voice){
+      voice_input(e, buf[i]);
+    }else{
+      command_input(e, buf[i], t);
+    }
+  }
+}
+
+// Makes the samples for the time that passed
+static void generate(struct emulator* e, uint64_t t){
+  if(e->next_event < e->settings.event_count){
+    const struct event* event = &e->settings.event[e->next_event];
+    if(t - e->voice_start >= (uint64_t)event->ms * 1000000){
+      if(out_put(e, (uint8_t[]){ C_DLE, event->code }, 2))
+        e->counters.events_sent++;
+      e->next_event++;
+    }
+  }
+  while(e->sample_credit >= 1){
+    e->sample_credit -= 1;
+    uint8_t sample;
+    if(!e->settings.loopback){
+      sample = e->ramp++;
+    }else if(e->loop_read != e->loop_write){
+      sample = e->loop[e->loop_read++ % LOOP_SIZE];
+    }else{
+      sample = SILENCE;
+      e->counters.loopback_underruns++;
+    }
+    if(e->settings.drop_ppm && rng_next(e) % 1000000 < e->settings.drop_ppm){
+      e->counters.samples_dropped++;
+      continue;
+    }
+    uint8_t shielded[2];
+    size_t size = 1;
+    size_t m = pcm_tty_dle_shield(shielded, sizeof(shielded), &sample, &size);
+    if(!out_put(e, shielded, m)){
+      e->counters.samples_lost++;
+      continue;
+    }
+    e->counters.samples_sent++;
+  }
+}
+
+static void transmit(struct emulator* e, uint64_t t){
+  if(t < e->hold_until)
+    return;
+  size_t n = e->out_end - e->out_start;
+  if(n > e->tx_credit)
+    n = e->tx_credit;
+  if(!n)
+    return;
+  ssize_t s = write(e->master, e->out + e->out_start, n);
+  if(s <= 0)
+    return;
+  e->out_start += s;
+  e->tx_credit -= s;
+  e->counters.bytes_sent += s;
+  if(e->settings.jitter_ms)
+    e->hold_until = t + rng_next(e) % ((uint64_t)e->settings.jitter_ms * 1000000);
+}
+
+static void tick(struct emulator* e, uint64_t t, uint64_t dt){
+  const struct settings* s = &e->settings;
+  if(s->stall_every_ms && t >= e->stall_start + (uint64_t)s->stall_every_ms * 1000000){
+    e->stall_start = t;
+    e->stall_end = t + (uint64_t)s->stall_ms * 1000000;
+    e->counters.stalls++;
+  }
+  if(e->voice)
+    e->sample_credit += (double)dt * s->samplerate / 1e9;
+  if(t < e->stall_end){
+    e->tx_credit = e->rx_credit = 0;
+  }else{
+    // With jitter, whatever was held back may go out in a burst afterwards
+    double line = (double)dt * s->baudrate / 10 / 1e9;
+    double max = (double)s->baudrate / 10 * (s->tick_ms + s->jitter_ms) / 1000 + 1;
+    e->tx_credit = e->tx_credit + line < max ? e->tx_credit + line : max;
+    // The modem only takes the voice data as fast as it plays it
+    if(e->voice && s->samplerate < s->baudrate / 10)
+      line = (double)dt * s->samplerate / 1e9;
+    e->rx_credit = e->rx_credit + line < max ? e->rx_credit + line : max;
+  }
+  if(e->result_due && t >= e->result_due){
+    reply(e, e->result);
+    e->result_due = 0;
+  }
+  if(t >= e->stall_end)
+    receive(e, t);
+  if(e->voice)
+    generate(e, t);
+  transmit(e, t);
+}
+
+static int emulator_open(struct emulator* e){
+  char pts[256];
+  if(openpty(&e->master, &e->slave, pts, 0, 0) == -1){
+    perror("openpty");
+    return -1;
+  }
+  fcntl(e->master, F_SETFL, fcntl(e->master, F_GETFL) | O_NONBLOCK);
+  struct termios termios;
+  tcgetattr(e->slave, &termios);
+  cfmakeraw(&termios);
+  tcsetattr(e->slave, TCSANOW, &termios);
+  unlink(e->link);
+  if(symlink(pts, e->link) == -1){
+    fprintf(stderr, "symlink %s -> %s failed: %s\n", e->link, pts, strerror(errno));
+    close(e->master);
+    close(e->slave);
+    return -1;
+  }
+  return 0;
+}
+
+static void emulator_close(struct emulator* e){
+  unlink(e->link);
+  close(e->master);
+  close(e->slave);
+}
+
+static void print_counters(const struct counters* c){
+  fprintf(stderr,
+    "bytes_sent         %"PRIu64"\n"
+    "bytes_received     %"PRIu64"\n"
+    "samples_sent       %"PRIu64"\n"
+    "samples_received   %"PRIu64"\n"
+    "samples_dropped    %"PRIu64"\n"
+    "samples_lost       %"PRIu64"\n"
+    "loopback_underruns %"PRIu64"\n"
+    "events_sent        %"PRIu64"\n"
+    "stalls             %"PRIu64"\n"
+    "voice_sessions     %"PRIu64"\n",
+    c->bytes_sent, c->bytes_received, c->samples_sent, c->samples_received, c->samples_dropped,
+    c->samples_lost, c->loopback_underruns, c->events_sent, c->stalls, c->voice_sessions
+  );
+}
+
+static void usage(const char* name){
+  fprintf(stderr,
+    "Usage: %s [options] /path/to/device\n"
+    "  -b baudrate      Line speed, default 115200\n"
+    "  -r samplerate    Voice samples per second, default 8000\n"
+    "  -t ms            Tick, default 1\n"
+    "  -c ms            Delay until ATD and ATA succeed, default 0\n"
+    "  -l               Send back the samples received instead of a ramp\n"
+    "  -e ms:code       Send DLE <code> that long after AT+VTR, up to %d times\n"
+    "  -D ppm           Drop that many of a million samples sent\n"
+    "  -j ms            Hold the line back for up to that long after each write\n"
+    "  -s every:ms      Stall the line every <every> ms for <ms> ms\n"
+    "  -S seed          Seed of the faults, default 1\n",
+    name, EVENTS_MAX
+  );
+}
+
+int main(int argc, char* argv[]){
+  static struct emulator e = {
+    .settings = {
+      .baudrate = 115200,
+      .samplerate = 8000,
+      .tick_ms = 1,
+      .seed = 1,
+    },
+    .echo = true,
+  };
+  struct settings* s = &e.settings;
+  int opt;
+  while((opt = getopt(argc, argv, "b:r:t:c:le:D:j:s:S:")) != -1){
+    bool ok = true;
+    switch(opt){
+      case 'b': ok = sscanf(optarg, "%u", &s->baudrate) == 1 && s->baudrate >= 10; break;
+      case 'r': ok = sscanf(optarg, "%u", &s->samplerate) == 1 && s->samplerate; break;
+      case 't': ok = sscanf(optarg, "%u", &s->tick_ms) == 1 && s->tick_ms; break;
+      case 'c': ok = sscanf(optarg, "%u", &s->connect_ms) == 1; break;
+      case 'l': s->loopback = true; break;
+      case 'e': {
+        struct event* event = &s->event[s->event_count];
+        ok = s->event_count < EVENTS_MAX && sscanf(optarg, "%u:%c", &event->ms, (char*)&event->code) == 2;
+        if(ok)
+          s->event_count++;
+      } break;
+      case 'D': ok = sscanf(optarg, "%u", &s->drop_ppm) == 1 && s->drop_ppm <= 1000000; break;
+      case 'j': ok = sscanf(optarg, "%u", &s->jitter_ms) == 1; break;
+      case 's': ok = sscanf(optarg, "%u:%u", &s->stall_every_ms, &s->stall_ms) == 2; break;
+      case 'S': ok = sscanf(optarg, "%"SCNu64, &s->seed) == 1; break;
+      default: ok = false; break;
+    }
+    if(!ok){
+      usage(argv[0]);
+      return 1;
+    }
+  }
+  if(optind != argc - 1){
+    usage(argv[0]);
+    return 1;
+  }
+  // Events are sent in order
+  for(unsigned i=1; i<s->event_count; i++)
+    for(unsigned j=i; j && s->event[j-1].ms > s->event[j].ms; j--){
+      struct event tmp = s->event[j];
+      s->event[j] = s->event[j-1];
+      s->event[j-1] = tmp;
+    }
+  e.link = argv[optind];
+  e.rng = s->seed ? s->seed : 1;
+
+  struct sigaction sa = { .sa_handler = on_signal };
+  sigaction(SIGINT, &sa, 0);
+  sigaction(SIGTERM, &sa, 0);
+  signal(SIGPIPE, SIG_IGN);
+
+  if(emulator_open(&e) == -1)
+    return 1;
+  fprintf(stderr, "Emulating a modem at %s, %u baud, %u Hz\n", e.link, s->baudrate, s->samplerate);
+
+  uint64_t last = now();
+  uint64_t next = last;
+  e.stall_start = last;
+  while(!stop){
+    next += (uint64_t)s->tick_ms * 1000000;
+    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &(struct timespec){ .tv_sec = next / 1000000000, .tv_nsec = next % 1000000000 }, 0);
+    uint64_t t = now();
+    tick(&e, t, t - last);
+    last = t;
+  }
+
+  emulator_close(&e);
+  print_counters(&e.counters);
+  return 0;
+}
@@ -1,6 +1,14 @@
 #include <sys/types.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+#include <sys/epoll.h>
+#include <sys/un.h>
+#include <sys/timerfd.h>
+#include <sys/ioctl.h>
+#include <stddef.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <stdlib.h>
@@ -8,179 +16,878 @@
 #include <stdint.h>
 #include <string.h>
 #include <stdio.h>
+#include <stdarg.h>
+#include <ctype.h>
 #include <errno.h>
-#include <poll.h>
 #include <grp.h>
 #include <pty.h>
+#include <termios.h>
+#include <pcm_tty_dle.h>
+#include <pcm_tty_shm.h>
+#include <pcm_tty_stats.h>
+#include <pcm_tty_segment.h>
 
-volatile uint8_t* shm;
-const char* userdef;
-int modem_fd = -1;
-int master = -1;
+enum {
+  MAX_CLIENTS = 16, // Connections per modem, only one playback and one capture client get past the handshake
+  FORWARD_SIZE = 1<<14,
+  BUFSIZE = 255
+};
+
+// Call setup and hangup. The daemon sends its own commands to the modem one step at a time
+// and swallows their results. It waits for the modem to answer instead of sleeping.
+enum setup_action {
+  SETUP_QUIET, // Discard modem output until it stays quiet for a moment
+  SETUP_COMMAND, // Send a command, wait for its result
+  SETUP_START_VTR, // Send AT+VTR, enter voice mode once the modem accepted it
+  SETUP_END_VTR, // Leave voice mode, wait for the modem to confirm it
+  SETUP_USER // Send a command of the fake modem user, its result gets forwarded
+};
+
+enum {
+  SETUP_STEPS_MAX = 8,
+  SETUP_QUIET_MS = 50,
+  SETUP_TIMEOUT_MS = 3000
+};
 
-int send_modem(const char* cmd){
-  dprintf(modem_fd, "%s\r", cmd);
+struct setup_step {
+  enum setup_action action;
+  char cmd[BUFSIZE+1];
+};
+
+struct setup {
+  struct setup_step step[SETUP_STEPS_MAX];
+  unsigned count;
+  unsigned current;
+  char line[64]; // The result line received so far
+  size_t line_size;
+  bool draining; // The DLE ETX waits until the modem took the rest of the playback chunk
+  int timer_fd;
+};
+
+struct fakemodem_parser_state {
+  char buf[BUFSIZE+1];
+  unsigned i;
+  bool error;
+  // Read but not yet parsed, parsing pauses during call setup
+  char input[4096];
+  size_t input_offset;
+  size_t input_size;
+};
+
+// What an epoll event is about
+enum watch_type {
+  WATCH_MODEM,
+  WATCH_FAKEMODEM,
+  WATCH_LISTEN,
+  WATCH_DOORBELL,
+  WATCH_SETUP_TIMER,
+  WATCH_CLIENT
+};
+
+struct watch {
+  struct modem* modem;
+  enum watch_type type;
+  int fd; // -1 while not registered
+  uint32_t events;
+};
+
+// Plugin instances, each one gets its own notify eventfd
+struct client {
+  int socket; // -1 if the slot is free
+  int notify_fd; // -1 until the handshake is done
+  int stream; // enum pcm_tty_shm_stream, -1 until the handshake is done
+  struct watch watch;
+};
+
+struct modem {
+  bool open;
+  const char* device;
+  const char* userdef;
+  char link[256]; // The fake modem symlink
+  struct pcm_tty_shm_control* control;
+  struct pcm_tty_stats* stats; // 0 if it couldn't be created
+  char stats_name[PCM_TTY_SEGMENT_NAME_MAX];
+  struct pcm_tty_ring* playback_ring;
+  struct pcm_tty_ring* capture_ring;
+  struct pcm_tty_v253_decoder decoder;
+  int modem_fd;
+  int master;
+  int slave; // Kept open, so the master doesn't hang up while nobody uses the fake modem
+  struct client clients[MAX_CLIENTS];
+  int listen_fd;
+  int doorbell_fd; // Shared by all clients
+
+  // Shielded playback audio not yet written to the modem
+  uint8_t playback_buf[1024];
+  size_t playback_buf_size;
+  size_t playback_buf_offset;
+  size_t playback_consumed; // The playback ring bytes in playback_buf
+
+  // Audio and line bytes of the last chunk in each direction, to tell how much audio the modem queues hold
+  size_t playback_audio, playback_line;
+  size_t capture_audio, capture_line;
+
+  // Modem output not yet written to the fake modem. It's in forward_pipe while splice works, in forward_buf otherwise.
+  int forward_pipe[2];
+  bool forward_splice;
+  uint8_t forward_buf[FORWARD_SIZE];
+  size_t forward_size;
+  size_t forward_offset;
+
+  struct setup setup;
+  struct fakemodem_parser_state fakemodem;
+
+  struct watch modem_watch;
+  struct watch fakemodem_watch;
+  struct watch listen_watch;
+  struct watch doorbell_watch;
+  struct watch setup_timer_watch;
+};
+
+int epoll_fd = -1;
+struct modem** modems;
+size_t modem_count;
+
+void modem_error(struct modem* m, const char* what){
+  fprintf(stderr, "%s: %s: %s\n", m->device, what, strerror(errno));
+}
+
+int watch_add(struct watch* w, struct modem* m, enum watch_type type, int fd, uint32_t events){
+  *w = (struct watch){ .modem = m, .type = type, .fd = fd, .events = events };
+  struct epoll_event ev = { .events = events, .data.ptr = w };
+  if(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) == -1){
+    w->fd = -1;
+    return -1;
+  }
   return 0;
 }
 
-void iflush(int fd){
-  static char devnull[4096];
-  tcflush(fd, TCIFLUSH);
-  for(int i=0; i<10; i++){
-    usleep(1000);
-    read(fd, devnull, sizeof(devnull));
+void watch_update(struct watch* w, uint32_t events){
+  if(w->fd == -1 || w->events == events)
+    return;
+  struct epoll_event ev = { .events = events, .data.ptr = w };
+  if(epoll_ctl(epoll_fd, EPOLL_CTL_MOD, w->fd, &ev) == 0)
+    w->events = events;
+}
+
+void watch_remove(struct watch* w){
+  if(w->fd == -1)
+    return;
+  epoll_ctl(epoll_fd, EPOLL_CTL_DEL, w->fd, 0);
+  w->fd = -1;
+}
+
+int send_modem(struct modem* m, const char* cmd){
+  dprintf(m->modem_fd, "%s\r", cmd);
+  return 0;
+}
+
+bool in_voice_mode(struct modem* m){
+  return m->control->state == PCM_TTY_SHM_STATE_VOICE;
+}
+
+void notify_clients(struct modem* m){
+  uint64_t one = 1;
+  for(size_t i=0; i<MAX_CLIENTS; i++)
+    if(m->clients[i].notify_fd != -1)
+      while(write(m->clients[i].notify_fd, &one, sizeof(one)) == -1 && errno == EINTR);
+}
+
+void set_state(struct modem* m, enum pcm_tty_shm_state state){
+  if(state != m->control->state)
+    pcm_tty_stats_add(m->stats, state == PCM_TTY_SHM_STATE_VOICE ? PCM_TTY_STATS_vtr_started : PCM_TTY_STATS_vtr_ended, 1);
+  __atomic_store_n(&m->control->state, state, __ATOMIC_RELEASE);
+  __atomic_add_fetch(&m->control->seq, 1, __ATOMIC_RELEASE);
+  pcm_tty_shm_futex_wake(&m->control->state);
+  notify_clients(m);
+}
+
+void setup_timer(struct modem* m, unsigned ms){
+  struct itimerspec its = {
+    .it_value = { .tv_sec = ms / 1000, .tv_nsec = ms % 1000 * 1000000L },
+  };
+  timerfd_settime(m->setup.timer_fd, 0, &its, 0);
+}
+
+bool playback_pending(struct modem* m){
+  return m->playback_buf_offset < m->playback_buf_size;
+}
+
+// Sends the DLE ETX of end_vtr once the modem took the rest of the playback chunk,
+// a DLE pair must never be cut in half.
+void end_vtr_drained(struct modem* m){
+  if(!m->setup.draining || playback_pending(m))
+    return;
+  m->setup.draining = false;
+  send_modem(m, "\x10\x03");
+  // The time to answer only starts now
+  setup_timer(m, SETUP_TIMEOUT_MS);
+}
+
+// Takes audio from the playback ring and writes it to the modem.
+// Outside of voice mode, it stays in the ring until there is somewhere to play it.
+int modem_playback(struct modem* m){
+  while(true){
+    if(m->playback_buf_offset == m->playback_buf_size){
+      bool progress = m->playback_consumed;
+      pcm_tty_ring_consume(m->playback_ring, m->playback_consumed);
+      m->playback_consumed = 0;
+      int32_t drop = __atomic_load_n(&m->control->playback_drop, __ATOMIC_ACQUIRE) - pcm_tty_ring_read_position(m->playback_ring);
+      if(drop > 0){
+        pcm_tty_stats_add(m->stats, PCM_TTY_STATS_playback_dropped, drop);
+        pcm_tty_ring_consume(m->playback_ring, drop);
+        progress = true;
+      }
+      if(progress)
+        notify_clients(m);
+      if(!in_voice_mode(m)){
+        end_vtr_drained(m);
+        return 0;
+      }
+      pcm_tty_stats_sample(m->stats, PCM_TTY_STATS_queue_depth, pcm_tty_ring_fill(m->playback_ring));
+      const uint8_t* data;
+      size_t n = pcm_tty_ring_peek(m->playback_ring, PCM_TTY_SHM_RING_SIZE, &data);
+      if(!n)
+        return 0;
+      m->playback_consumed = n;
+      m->playback_buf_size = pcm_tty_dle_shield(m->playback_buf, sizeof(m->playback_buf), data, &m->playback_consumed);
+      m->playback_buf_offset = 0;
+      pcm_tty_stats_add(m->stats, PCM_TTY_STATS_dle_inserted, m->playback_buf_size - m->playback_consumed);
+      m->playback_audio = m->playback_consumed;
+      m->playback_line = m->playback_buf_size;
+    }
+    size_t n = m->playback_buf_size - m->playback_buf_offset;
+    ssize_t s = write(m->modem_fd, m->playback_buf + m->playback_buf_offset, n);
+    if(s == -1){
+      if(errno == EINTR)
+        continue;
+      if(errno == EAGAIN){
+        pcm_tty_stats_add(m->stats, PCM_TTY_STATS_eagain, 1);
+        return 0;
+      }
+      modem_error(m, "write to modem failed");
+      return -1;
+    }
+    pcm_tty_stats_add(m->stats, PCM_TTY_STATS_bytes_written, s);
+    if((size_t)s < n)
+      pcm_tty_stats_add(m->stats, PCM_TTY_STATS_short_writes, 1);
+    m->playback_buf_offset += s;
   }
-  tcflush(fd, TCIFLUSH);
 }
 
-int start_vtr(void){
-  if(shm[0])
-    return 0;
-  iflush(modem_fd);
-  if(send_modem("AT+VTR") != -1){
-    iflush(modem_fd);
-    shm[0] = true;
-    return 0;
+bool forward_pending(struct modem* m){
+  return m->forward_offset < m->forward_size;
+}
+
+// Writes as much of the pending modem output to the fake modem as it takes
+int forward_flush(struct modem* m){
+  while(forward_pending(m)){
+    size_t n = m->forward_size - m->forward_offset;
+    ssize_t s;
+    if(m->forward_splice){
+      s = splice(m->forward_pipe[0], 0, m->master, 0, n, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+      if(s == -1 && errno == EINVAL){
+        // The fake modem can't be spliced to, get the data back out of the pipe
+        m->forward_splice = false;
+        ssize_t r;
+        while((r = read(m->forward_pipe[0], m->forward_buf, n)) == -1 && errno == EINTR);
+        m->forward_size = r > 0 ? r : 0;
+        m->forward_offset = 0;
+        continue;
+      }
+    }else{
+      s = write(m->master, m->forward_buf + m->forward_offset, n);
+    }
+    if(s == -1){
+      if(errno == EINTR)
+        continue;
+      if(errno == EAGAIN)
+        return 0;
+      modem_error(m, "write to fake modem failed");
+      return -1;
+    }
+    m->forward_offset += s;
   }
-  return -1;
+  m->forward_offset = m->forward_size = 0;
+  return 0;
 }
 
-int end_vtr(void){
-  if(!shm[0])
+// How much more output may be queued for the fake modem
+size_t forward_room(struct modem* m){
+  return FORWARD_SIZE - (m->forward_size - m->forward_offset);
+}
+
+// Queues output for the fake modem behind what's still pending and writes as much as it takes.
+// Only what doesn't fit into the queue anymore is dropped, the fake modem isn't reading at all then.
+int forward_write(struct modem* m, const void* data, size_t size){
+  size_t n = forward_room(m);
+  if(n > size)
+    n = size;
+  if(n && m->forward_splice){
+    // The pending output is in the pipe, so this has to go there too
+    ssize_t s;
+    while((s = write(m->forward_pipe[1], data, n)) == -1 && errno == EINTR);
+    n = s > 0 ? s : 0;
+  }else if(n){
+    memmove(m->forward_buf, m->forward_buf + m->forward_offset, m->forward_size - m->forward_offset);
+    m->forward_size -= m->forward_offset;
+    m->forward_offset = 0;
+    memcpy(m->forward_buf + m->forward_size, data, n);
+  }
+  m->forward_size += n;
+  if(n < size)
+    fprintf(stderr, "%s: fake modem isn't reading, dropped %zu bytes\n", m->device, size - n);
+  return forward_flush(m);
+}
+
+__attribute__((format(printf, 2, 3)))
+int forward_printf(struct modem* m, const char* format, ...){
+  char buf[256];
+  va_list args;
+  va_start(args, format);
+  int n = vsnprintf(buf, sizeof(buf), format, args);
+  va_end(args);
+  if(n < 0)
     return 0;
-  shm[0] = false;
-  int ret = send_modem("\x10\x03");
-  iflush(modem_fd);
+  return forward_write(m, buf, (size_t)n < sizeof(buf) ? (size_t)n : sizeof(buf) - 1);
+}
+
+// Passes modem output on to the fake modem, without copying it where the ttys support splice
+int modem_forward(struct modem* m){
+  if(forward_pending(m))
+    return forward_flush(m);
+  ssize_t s;
+  if(m->forward_splice){
+    s = splice(m->modem_fd, 0, m->forward_pipe[1], 0, FORWARD_SIZE, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if(s == -1 && errno == EINVAL){
+      m->forward_splice = false;
+      s = read(m->modem_fd, m->forward_buf, FORWARD_SIZE);
+    }
+  }else{
+    s = read(m->modem_fd, m->forward_buf, FORWARD_SIZE);
+  }
+  if(s == -1){
+    if(errno == EINTR || errno == EAGAIN)
+      return 0;
+    modem_error(m, "read from modem failed");
+    return -1;
+  }
+  pcm_tty_stats_add(m->stats, PCM_TTY_STATS_bytes_read, s);
+  m->forward_size = s;
+  m->forward_offset = 0;
+  return forward_flush(m);
 }
 
-int send_command(const char* cmd){
-  if(shm[0]){
+// Puts audio received from the modem into the capture ring. There must be room for decoder.dle bytes before it.
+int modem_capture(struct modem* m, uint8_t* buf, size_t headroom, size_t size){
+  size_t n = pcm_tty_v253_decode(&m->decoder, buf, buf + headroom, size);
+  // A DLE at the end is held back until the next read, it's not stripped yet
+  pcm_tty_stats_add(m->stats, PCM_TTY_STATS_dle_stripped, headroom + size - n - m->decoder.dle);
+  m->capture_audio = n;
+  m->capture_line = headroom + size;
+  // If nobody is recording, the ring just fills up and the rest gets dropped
+  size_t put = n ? pcm_tty_ring_put(m->capture_ring, PCM_TTY_SHM_RING_SIZE, buf, n) : 0;
+  pcm_tty_stats_add(m->stats, PCM_TTY_STATS_overrun_bytes, n - put);
+  if(put)
+    notify_clients(m);
+  // Events, like a hangup or a DLE ETX, are for whoever uses the fake modem
+  for(int event; (event = pcm_tty_v253_event_pop(&m->decoder)) != -1; )
+    if(forward_write(m, (uint8_t[]){ C_DLE, event }, 2) == -1)
+      return -1;
+  return 0;
+}
+
+// No new playback chunks are started from here on, modem_playback finishes the current one
+void end_vtr(struct modem* m){
+  if(!in_voice_mode(m))
+    return;
+  set_state(m, PCM_TTY_SHM_STATE_COMMAND);
+  m->setup.draining = true;
+  end_vtr_drained(m);
+}
+
+int send_command(struct modem* m, const char* cmd){
+  if(in_voice_mode(m)){
     // There is no good way to do this & make it work together with the also ioplug thing.
     // I should really do all this in the kernel using a line dicipline instead.
     // Let's just pretend everything is OK for now.
-/*    end_vtr();
-    send_modem(cmd);
-    dprintf(master, "%s\r\nOK\r\n", cmd);
-    start_vtr();*/
+/*    end_vtr(m);
+    send_modem(m, cmd);
+    forward_printf(m, "%s\r\nOK\r\n", cmd);
+    start_vtr(m);*/
     // Or, let's just pretend any command fails instead
-    dprintf(master, "%s\r\nERROR\r\n", cmd);
+    return forward_printf(m, "%s\r\nERROR\r\n", cmd);
   }else{
-    send_modem(cmd);
+    send_modem(m, cmd);
   }
   return 0;
 }
 
-int on_user_cmd(uint8_t* data){
-  if(!strncmp(data, "ATD", 3)){
-    iflush(modem_fd);
-    send_command("AT+FCLASS=8.0");
-    send_command("AT+FCLASS=8");
-    if(userdef)
-      send_command(userdef);
-    iflush(modem_fd);
-    usleep(2000);
-    iflush(modem_fd);
-  }else if(!strcmp(data, "AT+VTR")){
-    int ret = start_vtr();
-    // There is no good way to do this & make it work together with the also ioplug thing.
-    // I should really do all this in the kernel using a line dicipline instead.
-    // Let's just pretend everything is OK for now.
-    if(ret == 0){
-      dprintf(master, "AT+VTR\r\nOK\r\n");
-    }else{
-      dprintf(master, "AT+VTR\r\nERROR\r\n");
+void fakemodem_parse_input(struct modem* m);
+
+void setup_add(struct modem* m, enum setup_action action, const char* cmd){
+  struct setup* setup = &m->setup;
+  if(setup->count >= SETUP_STEPS_MAX){
+    fprintf(stderr, "%s: Too many setup steps\n", m->device);
+    return;
+  }
+  struct setup_step* step = &setup->step[setup->count++];
+  step->action = action;
+  snprintf(step->cmd, sizeof(step->cmd), "%s", cmd ? cmd : "");
+}
+
+bool setup_busy(struct modem* m){
+  return m->setup.current < m->setup.count;
+}
+
+// Whether the modem output is for the current setup step rather than for the fake modem
+bool setup_swallowing(struct modem* m){
+  return setup_busy(m) && m->setup.step[m->setup.current].action != SETUP_USER;
+}
+
+// Starts the next step. Steps which needn't wait for the modem are done right away.
+void setup_next(struct modem* m){
+  struct setup* setup = &m->setup;
+  while(setup_busy(m)){
+    struct setup_step* step = &setup->step[setup->current];
+    setup->line_size = 0;
+    switch(step->action){
+      case SETUP_QUIET: {
+        tcflush(m->modem_fd, TCIFLUSH);
+        setup_timer(m, SETUP_QUIET_MS);
+      } return;
+      case SETUP_COMMAND: {
+        send_modem(m, step->cmd);
+        setup_timer(m, SETUP_TIMEOUT_MS);
+      } return;
+      case SETUP_START_VTR: {
+        send_modem(m, "AT+VTR");
+        setup_timer(m, SETUP_TIMEOUT_MS);
+      } return;
+      case SETUP_END_VTR: {
+        if(!in_voice_mode(m))
+          break;
+        end_vtr(m);
+        setup_timer(m, SETUP_TIMEOUT_MS);
+      } return;
+      case SETUP_USER: {
+        send_modem(m, step->cmd);
+      } break;
     }
-    return ret;
-  }else if(!strcmp(data, "ATH")){
-    end_vtr();
-    iflush(modem_fd);
-    sleep(1);
-    iflush(modem_fd);
-    sleep(1);
-    iflush(modem_fd);
-    return send_command("ATH");
+    setup->current++;
   }
-  return send_command(data);
+  setup->count = setup->current = 0;
+  setup_timer(m, 0);
+  // Commands which arrived in the meantime
+  fakemodem_parse_input(m);
 }
 
-enum { BUFSIZE = 255 };
-struct fakemodem_parser_state {
-  uint8_t buf[BUFSIZE+1];
-  unsigned i;
-  bool error;
-};
+// The current step is over
+void setup_done(struct modem* m, bool ok){
+  struct setup_step* step = &m->setup.step[m->setup.current++];
+  if(step->action == SETUP_START_VTR){
+    if(ok){
+      memset(&m->decoder, 0, sizeof(m->decoder));
+      set_state(m, PCM_TTY_SHM_STATE_VOICE);
+    }
+    forward_printf(m, "AT+VTR\r\n%s\r\n", ok ? "OK" : "ERROR");
+  }
+  setup_next(m);
+}
 
-int read_fakemodem(struct fakemodem_parser_state* s){
-  int ret = read(master, s->buf+s->i, 1);
-  if(ret == 0)
+int setup_timeout(struct modem* m){
+  uint64_t count;
+  if(read(m->setup.timer_fd, &count, sizeof(count)) == -1 || !setup_busy(m))
     return 0;
-  if(ret < 0){
-    if(errno = EINTR)
+  // Nothing else can be sent to the modem before the rest of the chunk
+  if(m->setup.draining){
+    fprintf(stderr, "%s: The modem didn't take the rest of the playback audio in time\n", m->device);
+    return -1;
+  }
+  bool quiet = m->setup.step[m->setup.current].action == SETUP_QUIET;
+  if(!quiet)
+    fprintf(stderr, "%s: The modem didn't answer in time\n", m->device);
+  setup_done(m, quiet);
+  return 0;
+}
+
+// Returns 1 for a final result meaning success, -1 for one meaning failure, 0 for anything else
+int result_code(const char* line){
+  static const char*const ok[] = { "OK", "CONNECT", "VCON" };
+  static const char*const fail[] = { "ERROR", "NO CARRIER", "BUSY", "NO DIALTONE", "NO ANSWER" };
+  for(size_t i=0; i<sizeof(ok)/sizeof(*ok); i++)
+    if(!strncmp(line, ok[i], strlen(ok[i])))
+      return 1;
+  for(size_t i=0; i<sizeof(fail)/sizeof(*fail); i++)
+    if(!strncmp(line, fail[i], strlen(fail[i])))
       return -1;
-    perror("read failed");
+  return 0;
+}
+
+// Takes modem output during a setup step. Returns how much of it was for that step.
+size_t setup_input(struct modem* m, const uint8_t* buf, size_t size){
+  struct setup* setup = &m->setup;
+  if(setup->step[setup->current].action == SETUP_QUIET){
+    // Not quiet yet
+    setup_timer(m, SETUP_QUIET_MS);
+    return size;
+  }
+  // The modem still sends audio until it got the DLE ETX
+  if(setup->draining)
+    return size;
+  for(size_t i=0; i<size; i++){
+    char c = buf[i];
+    if(c != '\r' && c != '\n'){
+      if(setup->line_size < sizeof(setup->line) - 1)
+        setup->line[setup->line_size++] = c;
+      continue;
+    }
+    setup->line[setup->line_size] = 0;
+    setup->line_size = 0;
+    int result = result_code(setup->line);
+    if(result){
+      // Results end with CR LF, don't let the LF reach the capture ring
+      if(c == '\r' && i + 1 < size && buf[i+1] == '\n')
+        i++;
+      setup_done(m, result > 0);
+      return i + 1;
+    }
+  }
+  return size;
+}
+
+// Reads modem output during call setup. Whatever follows the final result goes where it normally would.
+int setup_read(struct modem* m){
+  uint8_t buf[1024];
+  // Don't take more from the modem than can be passed on if none of it gets swallowed
+  size_t size = sizeof(buf);
+  if(!in_voice_mode(m) && size > forward_room(m))
+    size = forward_room(m);
+  if(!size)
+    return 0;
+  ssize_t s = read(m->modem_fd, buf, size);
+  if(s == -1){
+    if(errno == EINTR || errno == EAGAIN)
+      return 0;
+    modem_error(m, "read from modem failed");
     return -1;
   }
-  if(s->error){
-    if(s->buf[s->i] != '\n')
+  size_t i = 0;
+  while(i < (size_t)s && setup_swallowing(m))
+    i += setup_input(m, buf + i, s - i);
+  if(i < (size_t)s){
+    if(in_voice_mode(m)){
+      // The decoder was just reset, there is nothing to make room for
+      return modem_capture(m, buf + i, 0, s - i);
+    }else{
+      return forward_write(m, buf + i, s - i);
+    }
+  }
+  return 0;
+}
+
+// Reads from the modem. In voice mode, the audio goes to the capture ring, anything else to the fake modem.
+int modem_read(struct modem* m){
+  if(setup_swallowing(m))
+    return setup_read(m);
+  if(!in_voice_mode(m))
+    return modem_forward(m);
+  uint8_t buf[1024];
+  // A DLE left over from the previous read may expand to two bytes, so leave room for that
+  size_t headroom = m->decoder.dle;
+  ssize_t s = read(m->modem_fd, buf + headroom, sizeof(buf) - headroom);
+  if(s == -1){
+    if(errno == EINTR || errno == EAGAIN)
       return 0;
-    dprintf(master, "ERROR\n");
+    modem_error(m, "read from modem failed");
+    return -1;
+  }
+  pcm_tty_stats_add(m->stats, PCM_TTY_STATS_bytes_read, s);
+  if(s > 0)
+    return modem_capture(m, buf, headroom, s);
+  return 0;
+}
+
+int on_user_cmd(struct modem* m, const char* data){
+  if(!strncmp(data, "ATD", 3)){
+    if(in_voice_mode(m))
+      return send_command(m, data);
+    setup_add(m, SETUP_QUIET, 0);
+    setup_add(m, SETUP_COMMAND, "AT+FCLASS=8.0");
+    setup_add(m, SETUP_COMMAND, "AT+FCLASS=8");
+    if(m->userdef)
+      setup_add(m, SETUP_COMMAND, m->userdef);
+    setup_add(m, SETUP_QUIET, 0);
+    setup_add(m, SETUP_USER, data);
+  }else if(!strcmp(data, "AT+VTR")){
+    if(in_voice_mode(m)){
+      return forward_printf(m, "AT+VTR\r\nOK\r\n");
+    }
+    setup_add(m, SETUP_QUIET, 0);
+    setup_add(m, SETUP_START_VTR, 0);
+  }else if(!strcmp(data, "ATH")){
+    setup_add(m, SETUP_END_VTR, 0);
+    setup_add(m, SETUP_QUIET, 0);
+    setup_add(m, SETUP_USER, "ATH");
+  }else{
+    return send_command(m, data);
+  }
+  setup_next(m);
+  return 0;
+}
+
+// Feeds one character of the fake modem input to the parser. Commands start with AT and end with a CR.
+void parse_fakemodem(struct modem* m, char c){
+  struct fakemodem_parser_state* s = &m->fakemodem;
+  if(s->error){
+    if(c != '\n')
+      return;
+    forward_printf(m, "ERROR\n");
+    s->error = false;
     s->i = 0;
-    return 0;
+    return;
   }
   if(s->i >= BUFSIZE){
     s->error = true;
     s->i = 0;
-    return 0;
+    return;
   }
-  if(s->i==1){
-    if(s->buf[1] == 'T'){
-      s->i++;
-      return 0;
-    }else{
+  if(s->i == 0){
+    if(c == 'A')
+      s->buf[s->i++] = c;
+    return;
+  }
+  if(s->i == 1){
+    if(c == 'T'){
+      s->buf[s->i++] = c;
+    }else if(c != 'A'){
       s->i = 0;
-      s->buf[0] = s->buf[1];
     }
+    return;
   }
-  if(s->i == 0){
-    if(s->buf[0]=='A'){
-      s->i++;
-      return 0;
-    }else{
-      s->i=0;
-      return 0;
-    }
-  }else if(s->buf[s->i] == '\r'){
+  if(c == '\r'){
     s->buf[s->i] = 0;
-    on_user_cmd(s->buf);
     s->i = 0;
+    on_user_cmd(m, s->buf);
+    return;
+  }
+  s->buf[s->i++] = c;
+}
+
+void fakemodem_parse_input(struct modem* m){
+  struct fakemodem_parser_state* s = &m->fakemodem;
+  while(s->input_offset < s->input_size && !setup_busy(m))
+    parse_fakemodem(m, s->input[s->input_offset++]);
+}
+
+// Parses everything the fake modem has available, a command may span several reads
+int read_fakemodem(struct modem* m){
+  struct fakemodem_parser_state* s = &m->fakemodem;
+  if(s->input_offset < s->input_size)
     return 0;
-  }else{
-    s->i++;
-    return 0;
+  ssize_t ret = read(m->master, s->input, sizeof(s->input));
+  if(ret < 0){
+    if(errno == EINTR || errno == EAGAIN)
+      return 0;
+    modem_error(m, "read failed");
+    return -1;
+  }
+  s->input_offset = 0;
+  s->input_size = ret;
+  fakemodem_parse_input(m);
+  return 0;
+}
+
+void drop_client(struct client* client){
+  watch_remove(&client->watch);
+  if(client->notify_fd != -1)
+    close(client->notify_fd);
+  close(client->socket);
+  client->socket = -1;
+  client->notify_fd = -1;
+  client->stream = -1;
+}
+
+// The handshake continues in client_hello once the plugin instance sent its stream
+void accept_client(struct modem* m){
+  int sock = accept4(m->listen_fd, 0, 0, SOCK_CLOEXEC | SOCK_NONBLOCK);
+  if(sock == -1)
+    return;
+  struct client* client = 0;
+  for(size_t i=0; i<MAX_CLIENTS && !client; i++)
+    if(m->clients[i].socket == -1)
+      client = &m->clients[i];
+  if(!client){
+    fprintf(stderr, "%s: Too many clients\n", m->device);
+    close(sock);
+    return;
+  }
+  // A hangup of the socket means the plugin instance is gone
+  if(watch_add(&client->watch, m, WATCH_CLIENT, sock, EPOLLIN) == -1){
+    modem_error(m, "epoll_ctl failed");
+    close(sock);
+    return;
+  }
+  client->socket = sock;
+  client->notify_fd = -1;
+  client->stream = -1;
+}
+
+int send_hello(int sock, uint8_t error, const int fds[2]){
+  union {
+    struct cmsghdr cmsg;
+    char buf[CMSG_SPACE(2 * sizeof(int))];
+  } cbuf;
+  memset(&cbuf, 0, sizeof(cbuf));
+  struct iovec iov = { .iov_base = (uint8_t[]){ PCM_TTY_SHM_VERSION, error }, .iov_len = 2 };
+  struct msghdr msg = {
+    .msg_iov = &iov,
+    .msg_iovlen = 1,
+  };
+  if(fds){
+    msg.msg_control = cbuf.buf;
+    msg.msg_controllen = sizeof(cbuf.buf);
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(2 * sizeof(int));
+    memcpy(CMSG_DATA(cmsg), fds, 2 * sizeof(int));
+  }
+  ssize_t ret;
+  while((ret = sendmsg(sock, &msg, MSG_NOSIGNAL)) == -1 && errno == EINTR);
+  return ret == -1 ? -1 : 0;
+}
+
+// Hands a new plugin instance its notify eventfd and the doorbell, unless its stream is taken already
+void client_hello(struct modem* m, struct client* client){
+  uint8_t stream;
+  ssize_t ret;
+  while((ret = recv(client->socket, &stream, 1, 0)) == -1 && errno == EINTR);
+  if(ret == -1 && errno == EAGAIN)
+    return;
+  if(ret != 1 || (stream != PCM_TTY_SHM_STREAM_PLAYBACK && stream != PCM_TTY_SHM_STREAM_CAPTURE)){
+    drop_client(client);
+    return;
+  }
+  for(size_t i=0; i<MAX_CLIENTS; i++){
+    if(m->clients[i].stream != stream)
+      continue;
+    fprintf(stderr, "%s: Refusing a second %s client\n", m->device, stream == PCM_TTY_SHM_STREAM_PLAYBACK ? "playback" : "capture");
+    send_hello(client->socket, EBUSY, 0);
+    drop_client(client);
+    return;
+  }
+  int notify_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if(notify_fd == -1){
+    modem_error(m, "eventfd failed");
+    drop_client(client);
+    return;
+  }
+  if(send_hello(client->socket, 0, (int[]){ notify_fd, m->doorbell_fd }) == -1){
+    modem_error(m, "sendmsg failed");
+    close(notify_fd);
+    drop_client(client);
+    return;
+  }
+  watch_update(&client->watch, 0);
+  client->notify_fd = notify_fd;
+  client->stream = stream;
+}
+
+int open_control_socket(struct modem* m, const char* name){
+  int error = 0;
+  struct sockaddr_un addr = { .sun_family = AF_UNIX };
+  size_t len = strlen(name);
+  memcpy(addr.sun_path + 1, name, len); // Abstract socket
+  m->listen_fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+  if(m->listen_fd == -1){
+    error = errno;
+    modem_error(m, "socket failed");
+    goto backout;
+  }
+  if(bind(m->listen_fd, (struct sockaddr*)&addr, offsetof(struct sockaddr_un, sun_path) + 1 + len) == -1){
+    error = errno;
+    modem_error(m, "bind failed, is there already a daemon for this modem?");
+    goto backout_socket;
+  }
+  if(listen(m->listen_fd, 4) == -1){
+    error = errno;
+    modem_error(m, "listen failed");
+    goto backout_socket;
+  }
+  m->doorbell_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if(m->doorbell_fd == -1){
+    error = errno;
+    modem_error(m, "eventfd failed");
+    goto backout_socket;
   }
   return 0;
+
+backout_socket:
+  close(m->listen_fd);
+backout:
+  errno = error;
+  return -1;
+}
+
+// Counters for pcm_tty_stats, the modem works without them too
+void open_stats(struct modem* m, dev_t rdev){
+  void* mem;
+  int error = pcm_tty_segment_create("tty-pcm-stats", rdev, "daemon", 0644, sizeof(struct pcm_tty_stats), m->stats_name, &mem);
+  if(error < 0){
+    errno = -error;
+    modem_error(m, "creating the stats segment failed");
+    return;
+  }
+  struct pcm_tty_stats* stats = mem;
+  stats->version = PCM_TTY_STATS_VERSION;
+  __atomic_store_n(&stats->magic, PCM_TTY_STATS_MAGIC, __ATOMIC_RELEASE);
+  m->stats = stats;
+}
+
+void close_stats(struct modem* m){
+  if(!m->stats)
+    return;
+  pcm_tty_segment_destroy(m->stats_name, m->stats, sizeof(struct pcm_tty_stats));
+  m->stats = 0;
 }
 
-int open_modem_and_shmem(const char* modem){
+int open_modem_and_shmem(struct modem* m){
   int error = 0;
-  modem_fd = open(modem, O_RDWR | O_NOCTTY | O_NONBLOCK);
+  m->modem_fd = open(m->device, O_RDWR | O_NOCTTY | O_NONBLOCK);
   struct stat ttystat;
 
-  if(modem_fd == -1){
+  if(m->modem_fd == -1){
     error = errno;
-    fprintf(stderr, "Failed to open tty device (%s): %s\n", modem, strerror(error));
+    fprintf(stderr, "Failed to open tty device (%s): %s\n", m->device, strerror(error));
     goto backout;
   }
 
-  if(fstat(modem_fd, &ttystat) == -1){
+  if(fstat(m->modem_fd, &ttystat) == -1){
     error = errno;
-    fprintf(stderr, "Failed to stat tty device (%s): %s\n", modem, strerror(error));
+    fprintf(stderr, "Failed to stat tty device (%s): %s\n", m->device, strerror(error));
     goto backout_dev_open;
   }
 
   if(!S_ISCHR(ttystat.st_mode)){
     error = EINVAL;
-    fprintf(stderr, "specified tty device file (%s) is not a character device file\n", modem);
+    fprintf(stderr, "specified tty device file (%s) is not a character device file\n", m->device);
+    goto backout_dev_open;
+  }
+
+  // The audio is binary, the tty mustn't touch it
+  struct termios termios;
+  if(tcgetattr(m->modem_fd, &termios) == -1){
+    error = errno;
+    modem_error(m, "tcgetattr failed");
+    goto backout_dev_open;
+  }
+  cfmakeraw(&termios);
+  termios.c_cc[VMIN]  = 0;
+  termios.c_cc[VTIME] = 0;
+  if(tcsetattr(m->modem_fd, TCSANOW, &termios) == -1){
+    error = errno;
+    modem_error(m, "tcsetattr failed");
     goto backout_dev_open;
   }
 
@@ -189,60 +896,308 @@ int open_modem_and_shmem(const char* modem){
   int shm_fd = shm_open(shm_name, O_CREAT | O_RDWR, 0666);
   if(shm_fd == -1){
     error = errno;
-    perror("shm_open failed");
+    modem_error(m, "shm_open failed");
     goto backout_dev_open;
   }
-  if(ftruncate(shm_fd, 4096) == -1){
+  if(ftruncate(shm_fd, PCM_TTY_SHM_SIZE) == -1){
     error = errno;
-    perror("ftruncate failed");
+    modem_error(m, "ftruncate failed");
     goto backout_shm_open;
   }
-  shm = mmap(0, 4096, PROT_READ | PROT_WRITE, MAP_SHARED, shm_fd, 0);
-  if(shm == MAP_FAILED){
+  void* mem = mmap(0, PCM_TTY_SHM_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, shm_fd, 0);
+  if(mem == MAP_FAILED){
     error = errno;
-    perror("mmap failed\n");
+    modem_error(m, "mmap failed");
     goto backout_shm_open;
   }
   close(shm_fd);
 
+  if(open_control_socket(m, shm_name) == -1){
+    error = errno;
+    goto backout_mmap;
+  }
+
+  // Clients must not use it until it's valid again
+  struct pcm_tty_shm_control* control = mem;
+  __atomic_store_n(&control->magic, 0, __ATOMIC_RELEASE);
+  memset(mem, 0, PCM_TTY_SHM_PAGE);
+  control->version = PCM_TTY_SHM_VERSION;
+  control->size = PCM_TTY_SHM_SIZE;
+  control->state = PCM_TTY_SHM_STATE_COMMAND;
+  control->playback_ring = PCM_TTY_SHM_PLAYBACK_RING;
+  control->capture_ring = PCM_TTY_SHM_CAPTURE_RING;
+  m->control = control;
+  m->playback_ring = pcm_tty_shm_ring(mem, PCM_TTY_SHM_PLAYBACK_RING);
+  m->capture_ring = pcm_tty_shm_ring(mem, PCM_TTY_SHM_CAPTURE_RING);
+  pcm_tty_ring_init(m->playback_ring, PCM_TTY_SHM_RING_SIZE);
+  pcm_tty_ring_init(m->capture_ring, PCM_TTY_SHM_RING_SIZE);
+  __atomic_store_n(&control->magic, PCM_TTY_SHM_MAGIC, __ATOMIC_RELEASE);
+
+  open_stats(m, ttystat.st_rdev);
   return 0;
 
+backout_mmap:
+  munmap(mem, PCM_TTY_SHM_SIZE);
+  goto backout_dev_open;
 backout_shm_open:
   close(shm_fd);
 backout_dev_open:
-  close(modem_fd);
+  close(m->modem_fd);
 backout:
   errno = error;
   return -1;
 }
 
-int main(int argc, char* argv[]){
-  if(argc != 2 && argc != 3){
-    fprintf(stderr, "Usage: %s /dev/ttyACM123 [userdefined-at-sequence]\n", argv[0]);
-    return 1;
+// Takes the modem out of service, the other ones keep working
+void modem_close(struct modem* m){
+  if(!m->open)
+    return;
+  m->open = false;
+  fprintf(stderr, "%s: closing\n", m->device);
+  watch_remove(&m->modem_watch);
+  watch_remove(&m->fakemodem_watch);
+  watch_remove(&m->listen_watch);
+  watch_remove(&m->doorbell_watch);
+  watch_remove(&m->setup_timer_watch);
+  for(size_t i=0; i<MAX_CLIENTS; i++)
+    if(m->clients[i].socket != -1)
+      drop_client(&m->clients[i]);
+  // Plugin instances still attached to the rings must not wait for us
+  m->control->daemon_sleeping = false;
+  set_state(m, PCM_TTY_SHM_STATE_COMMAND);
+  __atomic_store_n(&m->control->magic, 0, __ATOMIC_RELEASE);
+  munmap(m->control, PCM_TTY_SHM_SIZE);
+  close_stats(m);
+  if(*m->link)
+    unlink(m->link);
+  close(m->setup.timer_fd);
+  close(m->forward_pipe[0]);
+  close(m->forward_pipe[1]);
+  close(m->slave);
+  close(m->master);
+  close(m->doorbell_fd);
+  close(m->listen_fd);
+  close(m->modem_fd);
+}
+
+int modem_open(struct modem* m, const char* device, const char* userdef){
+  memset(m, 0, sizeof(*m));
+  m->device = device;
+  m->userdef = userdef;
+  m->forward_splice = true;
+  m->master = m->slave = -1;
+  m->forward_pipe[0] = m->forward_pipe[1] = -1;
+  m->setup.timer_fd = -1;
+  struct watch* watches[] = { &m->modem_watch, &m->fakemodem_watch, &m->listen_watch, &m->doorbell_watch, &m->setup_timer_watch };
+  for(size_t i=0; i<sizeof(watches)/sizeof(*watches); i++)
+    watches[i]->fd = -1;
+  for(size_t i=0; i<MAX_CLIENTS; i++)
+    m->clients[i].socket = m->clients[i].notify_fd = m->clients[i].stream = -1;
+
+  if(open_modem_and_shmem(m) == -1){
+    modem_error(m, "open_modem_and_shmem failed");
+    return -1;
+  }
+  m->open = true;
+  if(openpty(&m->master, &m->slave, 0, 0, 0) == -1){
+    modem_error(m, "openpty failed");
+    goto backout;
+  }
+  // Whoever uses the fake modem may not read it for a while, that mustn't block the daemon
+  fcntl(m->master, F_SETFL, fcntl(m->master, F_GETFL) | O_NONBLOCK);
+  if(pipe2(m->forward_pipe, O_CLOEXEC | O_NONBLOCK) == -1){
+    modem_error(m, "pipe2 failed");
+    goto backout;
+  }
+  m->setup.timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  if(m->setup.timer_fd == -1){
+    modem_error(m, "timerfd_create failed");
+    goto backout;
+  }
+
+  snprintf(m->link, sizeof(m->link), "%s:AT", device);
+  unlink(m->link);
+  if(symlink(ptsname(m->master), m->link) == -1){
+    modem_error(m, "symlink failed");
+    goto backout;
+  }
+
+  if( watch_add(&m->modem_watch, m, WATCH_MODEM, m->modem_fd, EPOLLIN) == -1
+   || watch_add(&m->fakemodem_watch, m, WATCH_FAKEMODEM, m->master, EPOLLIN) == -1
+   || watch_add(&m->listen_watch, m, WATCH_LISTEN, m->listen_fd, EPOLLIN) == -1
+   || watch_add(&m->doorbell_watch, m, WATCH_DOORBELL, m->doorbell_fd, EPOLLIN) == -1
+   || watch_add(&m->setup_timer_watch, m, WATCH_SETUP_TIMER, m->setup.timer_fd, EPOLLIN) == -1
+  ){
+    modem_error(m, "epoll_ctl failed");
+    goto backout;
+  }
+  return 0;
+
+backout:
+  // modem_close copes with the parts which weren't set up yet
+  modem_close(m);
+  return -1;
+}
+
+// Line bytes to audio bytes, at the ratio of the last chunk
+uint32_t unshielded(int queued, size_t audio, size_t line){
+  if(queued <= 0)
+    return 0;
+  return line ? (uint64_t)queued * audio / line : (uint32_t)queued;
+}
+
+// Lets the plugin count what the modem hasn't sent or we haven't read yet in its delay
+void publish_queues(struct modem* m){
+  int outq = 0, inq = 0;
+  if(in_voice_mode(m)){
+    if(ioctl(m->modem_fd, TIOCOUTQ, &outq) == -1)
+      outq = 0;
+    if(ioctl(m->modem_fd, TIOCINQ, &inq) == -1)
+      inq = 0;
+  }
+  __atomic_store_n(&m->control->modem_outq, unshielded(outq, m->playback_audio, m->playback_line), __ATOMIC_RELAXED);
+  __atomic_store_n(&m->control->modem_inq, unshielded(inq, m->capture_audio, m->capture_line), __ATOMIC_RELAXED);
+}
+
+// Registers interest in what the modem can make progress on next. Returns true if it shouldn't be waited for.
+bool modem_prepare_wait(struct modem* m){
+  publish_queues(m);
+  // The modem is ours alone now. Wait for it to take more audio if it couldn't take it all.
+  uint32_t modem_events = EPOLLIN | (playback_pending(m) ? EPOLLOUT : 0);
+  uint32_t fakemodem_events = EPOLLIN;
+  // Modem output waits in the kernel until the fake modem took the previous chunk
+  if(forward_pending(m)){
+    fakemodem_events |= EPOLLOUT;
+    if(!in_voice_mode(m) && (!setup_swallowing(m) || !forward_room(m)))
+      modem_events &= ~EPOLLIN;
   }
-  if(argc == 3)
-    userdef = argv[2];
-  if(open_modem_and_shmem(argv[1]) == -1){
-    perror("open_modem_and_shmem failed");
+  // New commands have to wait until the call setup is done
+  if(setup_busy(m))
+    fakemodem_events &= ~EPOLLIN;
+  watch_update(&m->modem_watch, modem_events);
+  watch_update(&m->fakemodem_watch, fakemodem_events);
+
+  // Let the plugin ring the doorbell if it adds playback audio while we wait
+  if(in_voice_mode(m) && !playback_pending(m)){
+    __atomic_store_n(&m->control->daemon_sleeping, true, __ATOMIC_SEQ_CST);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if(pcm_tty_ring_fill(m->playback_ring))
+      return true;
+  }
+  return false;
+}
+
+int modem_event(struct watch* w, uint32_t events){
+  struct modem* m = w->modem;
+  switch(w->type){
+    case WATCH_MODEM: {
+      if(events & EPOLLIN)
+        if(modem_read(m) == -1)
+          return -1;
+      // Gone, like an unplugged USB modem. Whatever it still sent was read above.
+      if(events & (EPOLLERR | EPOLLHUP)){
+        fprintf(stderr, "%s: hung up\n", m->device);
+        return -1;
+      }
+    } break;
+    case WATCH_FAKEMODEM: {
+      if(events & EPOLLOUT)
+        if(forward_flush(m) == -1)
+          return -1;
+      if(events & EPOLLIN)
+        return read_fakemodem(m);
+    } break;
+    case WATCH_LISTEN: {
+      accept_client(m);
+    } break;
+    case WATCH_DOORBELL: {
+      uint64_t count;
+      while(read(m->doorbell_fd, &count, sizeof(count)) == -1 && errno == EINTR);
+    } break;
+    case WATCH_SETUP_TIMER: {
+      if(setup_timeout(m) == -1)
+        return -1;
+    } break;
+    case WATCH_CLIENT: {
+      struct client* client = (struct client*)((char*)w - offsetof(struct client, watch));
+      if(events & (EPOLLHUP | EPOLLERR))
+        drop_client(client);
+      else if(events & EPOLLIN)
+        client_hello(m, client);
+    } break;
+  }
+  return 0;
+}
+
+bool add_modem(const char* device, const char* userdef){
+  struct modem** list = realloc(modems, sizeof(*modems) * (modem_count + 1));
+  if(!list)
+    return false;
+  modems = list;
+  struct modem* m = malloc(sizeof(*m));
+  if(!m)
+    return false;
+  if(modem_open(m, device, userdef) == -1){
+    free(m);
+    return true; // The other modems may still work
+  }
+  modems[modem_count++] = m;
+  return true;
+}
+
+// One modem per line, the device followed by an optional user defined AT sequence. Lines starting with # are comments.
+bool read_config(const char* file){
+  FILE* f = fopen(file, "r");
+  if(!f){
+    perror(file);
+    return false;
+  }
+  char* line = 0;
+  size_t size = 0;
+  bool ok = true;
+  while(ok && getline(&line, &size, f) != -1){
+    char* device = line;
+    while(isspace((unsigned char)*device))
+      device++;
+    if(!*device || *device == '#')
+      continue;
+    char* end = device + strcspn(device, " \t\r\n");
+    char* userdef = end + strspn(end, " \t");
+    *end = 0;
+    userdef[strcspn(userdef, "\r\n")] = 0;
+    ok = add_modem(strdup(device), *userdef ? strdup(userdef) : 0);
+  }
+  free(line);
+  fclose(f);
+  return ok;
+}
+
+int main(int argc, char* argv[]){
+  if(argc < 2){
+    fprintf(stderr, "Usage: %s [-c config-file] [[-u userdefined-at-sequence] /dev/ttyACM123]...\n", argv[0]);
     return 1;
   }
-  int slave = -1;
-  if(openpty(&master, &slave, 0, 0, 0) == -1){
-    perror("openpty failed");
+  epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  if(epoll_fd == -1){
+    perror("epoll_create1 failed");
     return 1;
   }
-  close(slave);
-  struct fakemodem_parser_state fms;
-  memset(&fms, 0, sizeof(fms));
-
-  {
-    char buf[256] = {0};
-    char* dst = ptsname(master);
-    snprintf(buf, sizeof(buf), "%s:AT", argv[1]);
-    unlink(buf);
-    if(symlink(dst, buf) == -1){
-      perror("symlink failed");
+
+  // A user defined AT sequence is for the modem after it
+  const char* userdef = 0;
+  for(int i=1; i<argc; i++){
+    bool ok;
+    if(!strcmp(argv[i], "-c") && i+1 < argc){
+      ok = read_config(argv[++i]);
+    }else if(!strcmp(argv[i], "-u") && i+1 < argc){
+      userdef = argv[++i];
+      continue;
+    }else{
+      ok = add_modem(argv[i], userdef);
+      userdef = 0;
+    }
+    if(!ok){
+      perror("adding modem failed");
       return 1;
     }
   }
@@ -252,47 +1207,46 @@ int main(int argc, char* argv[]){
   setgid(65534);
   setuid(65534);
 
-  enum {
-    PFD_FAKEMODEM,
-    PFD_REALMODEM
-  };
-
-  struct pollfd fds[] = {
-    [PFD_FAKEMODEM] = {
-      .fd = master,
-      .events = POLLIN
-    },
-    [PFD_REALMODEM] = {
-      .fd = modem_fd,
-      .events = POLLIN
-    },
-  };
-
   while(true){
 
-    int ret = poll(fds, 1 + !shm[0], -1);
+    size_t open_count = 0;
+    int timeout = -1;
+    for(size_t i=0; i<modem_count; i++){
+      if(!modems[i]->open)
+        continue;
+      open_count++;
+      if(modem_prepare_wait(modems[i]))
+        timeout = 0;
+    }
+    if(!open_count){
+      fprintf(stderr, "No usable modems left\n");
+      return 1;
+    }
+
+    struct epoll_event events[64];
+    int ret = epoll_wait(epoll_fd, events, sizeof(events)/sizeof(*events), timeout);
+    for(size_t i=0; i<modem_count; i++)
+      if(modems[i]->open)
+        __atomic_store_n(&modems[i]->control->daemon_sleeping, false, __ATOMIC_SEQ_CST);
     if( ret == -1 ){
       if( errno == EINTR )
         continue;
-      perror("poll failed");
+      perror("epoll_wait failed");
       return 1;
     }
-    if(!ret)
-      continue;
 
-    if(fds[PFD_FAKEMODEM].revents & POLLIN){
-      if(read_fakemodem(&fms) == -1)
-        return 1;
+    for(int i=0; i<ret; i++){
+      struct watch* w = events[i].data.ptr;
+      // An earlier event may have closed it
+      if(w->fd == -1 || !w->modem->open)
+        continue;
+      if(modem_event(w, events[i].events) == -1)
+        modem_close(w->modem);
     }
 
-    if(!shm[0] && fds[PFD_REALMODEM].revents & POLLIN){
-      char buf[256];
-      ssize_t s = read(modem_fd, buf, sizeof(buf));
-      if(s == -1 && errno != EINTR)
-        return -1;
-      if(s > 0)
-        while(write(master, buf, s) == -1 && errno == EINTR);
-    }
+    for(size_t i=0; i<modem_count; i++)
+      if(modems[i]->open && modem_playback(modems[i]) == -1)
+        modem_close(modems[i]);
 
   }
   return 0;